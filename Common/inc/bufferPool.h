@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+#include "messageQueue.h"
+
+/* fixed-size blocks in the SRAM4_MQ region for payloads too large to copy through a queue ring. One core allocates a
+ * block, fills it in place and sends a small message carrying the block's 4-byte handle, the other core reads the
+ * block in place and frees it. Blocks are freed without locks, the receiving core pushes the block index onto a return
+ * ring that the allocating core drains the next time it runs out of blocks. */
+
+#define BP_BLOCK_SIZE MQ_MAX_MESSAGE_SIZE				// bytes in each block, a whole Ethernet frame
+#define BP_MAX_BLOCKS 32								// most blocks a pool may have, one bit each in the free mask
+#define BP_POOL_COUNT 2									// number of PoolIDs
+
+namespace bufferPool
+{
+	// one pool per direction, the sending core allocates and initializes it. Even IDs go from the M4 to the M7, odd IDs
+	// from the M7 to the M4.
+	enum PoolID {
+		M4toM7_Pool = 0,
+		M7toM4_Pool = 1
+	};
+	
+	// identifies a block of a pool, 0 is never a valid handle
+	typedef uint32_t BlockHandle;
+	
+	// payload of a message sent with sendBlock
+	struct BlockMessage {
+		BlockHandle handle;
+		uint32_t dataLen;								// bytes of the block the sender filled in
+	};
+	
+	
+	void init(PoolID poolID);
+	
+	// take a free block for the sending core to fill in, returns 0 if every block is still in use
+	BlockHandle alloc(PoolID poolID);
+	uint8_t* data(BlockHandle handle);					// word aligned start of the block's BP_BLOCK_SIZE bytes
+	uint32_t freeBlocks(PoolID poolID);					// blocks alloc can still hand out, returned blocks included
+	
+	// hand a filled in block to the other core as a BlockMessage. The block stays with the sender unless SendOK is
+	// returned, so a dropped block has to be freed or sent again. Sending a block this core does not hold is a
+	// SYS_ERROR and returns SendTooLarge without sending anything.
+	messageQueue::SendStatus sendBlock(messageQueue::MessageQueueID msgQueueID, MessageID messageID, BlockHandle handle,
+		uint16_t dataLen, messageQueue::SendMode mode = messageQueue::SendDrop, uint32_t timeout = 0);
+	
+	// the block carried by a BlockMessage, valid until the receiver frees it. Returns 0 if the handle is not valid or
+	// not from the sending core's pool, every such message is counted.
+	const uint8_t* receiveBlock(const BlockMessage* msg);
+	uint32_t getRejectedBlocks(void);
+	
+	// give a block back to its pool, either core may free a block it holds. Freeing a block this core does not hold,
+	// because it was already freed or, on the sending core, already sent, is a SYS_ERROR.
+	void free(BlockHandle handle);
+}
@@ -19,15 +19,30 @@ namespace hsem
 		m7_coreID = 3
 	};
 	
+	// the ID of the core this code is compiled for, use it when locking so the two cores can exclude each other
+#ifdef CORE_CM4
+	const Core_ID localCoreID = m4_coreID;
+#else
+	const Core_ID localCoreID = m7_coreID;
+#endif
+	
 	// the hardware semaphores are numbered 0-31, assign them to controlled resources
 	enum HSEM_ID : uint8_t
 	{
 		hsemID_M4toM7 = 0,
-		hsemID_M7toM4 = 1
+		hsemID_M7toM4 = 1,
+		hsemID_DoorbellM4toM7 = 2,					// released by the M4 to interrupt the M7 when it sends a message
+		hsemID_DoorbellM7toM4 = 3,					// released by the M7 to interrupt the M4 when it sends a message
+		hsemID_M4toM7_Control = 4,
+		hsemID_M7toM4_Control = 5,
+		hsemID_M4toM7_Bulk = 6,
+		hsemID_M7toM4_Bulk = 7
 	};
 	
 	void init(void);								// turn on HSEM clock, clear all semaphores
 	bool lock(HSEM_ID hsemID, Core_ID coreID);		// 1-step semaphore take, returns true if successful
 	void unlock(HSEM_ID hsemID, Core_ID coreID);	// release the semaphore
 	bool isLocked(HSEM_ID hsemID);					// returns lock status regardless of core 
+	void enableInterrupt(HSEM_ID hsemID);			// interrupt this core whenever the semaphore is released
+	void clearInterrupt(HSEM_ID hsemID);			// clear this core's interrupt status for the semaphore
 }
@@ -0,0 +1,116 @@
+#pragma once
+#include <stdint.h>
+#include "messageQueue.h"
+
+/* benchmark of the message queues between the cores, for regression numbers whenever the ring format or locking
+ * changes. The sending core sweeps message size, burst length and queue fill level on one lane, every combination is a
+ * case of messages sent with sendMessage. Before each burst the queue is topped up to the case's fill level with NoOp
+ * messages no larger than the room left below it, then the burst is sent back to back without waiting, so full queues
+ * show up as drops. A case whose fill level leaves no room for one of its messages is skipped. The receiving core
+ * times every BenchData message from its send timestamp to its dispatch and reports each case back in a BenchResult.
+ * Both cores pass BenchControl, BenchData and BenchResult messages to handleMessage, the sending core calls update
+ * regularly. The lane has to be initialized with timestamps for the latencies.
+ *
+ * copyBench times the payload copy on its own, on one core without sending anything, so changes to copyBytes can be
+ * checked against the byte at a time copy the ring started out with and against memcpy. It copies into and out of the
+ * ring of an idle lane, so the numbers include SRAM4 across the D3 bus like a real send or read. */
+
+#define IPC_BENCH_MAX_STEPS 8							// entries per sweep dimension
+#define IPC_BENCH_HISTOGRAM_SIZE 240					// latency buckets, 8 per power of two so within 12.5%
+#define IPC_BENCH_RESULT_MILLIS 1000					// how long the sender waits for a case's BenchResult
+#define IPC_BENCH_COPY_REPEATS 256						// copies timed together for each size and copy
+#define IPC_BENCH_COPY_RING 4096						// bytes the byte loop wraps at, no more than the lane's ring
+
+namespace ipcBench
+{
+	// what a BenchControl message asks the receiving core to do
+	enum BenchCommand : uint32_t {
+		BenchStart = 0,									// reset the counters for a new case
+		BenchEnd = 1,									// all of the case has been sent, report it
+		BenchSweepDone = 2								// the last case has been reported
+	};
+	
+	// one combination of the sweep, also the payload of a BenchControl message
+	struct BenchCase {
+		BenchCommand command;
+		uint32_t caseID;
+		uint32_t messages;								// BenchData messages the sender attempts, drops included
+		uint16_t size;									// payload bytes of each message
+		uint16_t burst;									// messages sent back to back before waiting for the queue to empty
+		uint16_t fillPercent;							// ring fill level each burst starts from
+		uint16_t msgQueueID;
+	};
+	
+	// the receiving core's measurements of a case, payload of a BenchResult message, latencies in timebase ticks
+	struct CaseResult {
+		uint32_t caseID;
+		uint32_t messagesReceived;
+		uint32_t bytesReceived;
+		uint32_t elapsedTicks;							// first message sent to last message dispatched
+		uint32_t p50Ticks;								// percentiles are bucket upper bounds
+		uint32_t p99Ticks;
+		uint32_t maxTicks;
+	};
+	
+	// everything known about a finished case once its result is back on the sending core
+	struct CaseReport {
+		BenchCase benchCase;
+		CaseResult result;
+		uint32_t messagesSent;							// accepted by sendMessage
+		uint32_t messagesDropped;						// sendMessage found no room
+		bool timedOut;									// no BenchResult came back, the result is all zero
+		bool skipped;									// the fill level leaves no room for one message, nothing was sent
+	};
+	
+	// the dimensions of a sweep, sizes above the lane's largest payload are clamped to it
+	struct SweepConfig {
+		messageQueue::MessageQueueID msgQueueID;		// lane to measure, sent by this core
+		uint32_t messagesPerCase;
+		uint32_t sizeCount;
+		uint16_t sizes[IPC_BENCH_MAX_STEPS];
+		uint32_t burstCount;
+		uint16_t bursts[IPC_BENCH_MAX_STEPS];
+		uint32_t fillCount;
+		uint16_t fillPercents[IPC_BENCH_MAX_STEPS];
+	};
+	
+	// cycles of this core's clock that IPC_BENCH_COPY_REPEATS copies of one size took with each copy
+	struct CopyCycles {
+		uint32_t byteLoopCycles;						// one byte at a time, wrapping the ring index every byte
+		uint32_t copyBytesCycles;						// messageQueue::copyBytes
+		uint32_t memcpyCycles;							// the C library's memcpy
+	};
+	
+	struct CopyResult {
+		uint32_t size;
+		CopyCycles write;								// from this core's RAM into the lane's ring
+		CopyCycles read;								// from the lane's ring into this core's RAM
+	};
+	
+	// runs on the sending core for every finished case
+	typedef void (*ReportCallback)(const CaseReport* report);
+	
+	
+	// the default report, one comma separated line per case with integer fields, printHeader names the columns
+	void printHeader(void);
+	void printReport(const CaseReport* report);
+	
+	// the default sweep on a lane, 0 to MQ_MAX_MESSAGE_SIZE bytes, bursts of 1 to 32 and fill levels of 0 to 90%
+	void defaultSweep(messageQueue::MessageQueueID msgQueueID, SweepConfig* config);
+	
+	// start a sweep, returns false if one is already running on this core. The receiving core needs no setup.
+	bool startSweep(const SweepConfig* config, ReportCallback report = printReport);
+	bool running(void);									// this core has a sweep in progress
+	uint32_t completedSweeps(void);						// sweeps the other core finished sending to this one
+	
+	void handleMessage(const messageQueue::MessageView* msg);	// pass every BenchControl, BenchData and BenchResult here
+	void update(void);											// sends the next burst or case of a running sweep
+	
+	// time copying size bytes, up to MQ_MAX_MESSAGE_SIZE, between a word aligned buffer in this core's RAM and the ring
+	// of a lane this core sends on. The lane must have nothing queued or reserved and a ring of at least
+	// IPC_BENCH_COPY_RING bytes, its ring is overwritten. The copy report prints a line per direction with bytes per
+	// cycle, printCopyHeader names its columns.
+	void copyBench(messageQueue::MessageQueueID msgQueueID, uint32_t size, CopyResult* result);
+	void printCopyHeader(void);
+	void printCopyResult(const CopyResult* result);
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+#include "messageID.h"
+
+/* latest-value mailboxes for state messages where only the newest value matters, e.g. SetLED. Each mailbox holds a single
+ * value in SRAM4 next to the message queues, the writer overwrites it in place and the reader takes a consistent
+ * snapshot without locks. A sequence counter protects the value (seqlock), it is odd while a write is in progress and
+ * the reader retries if the counter changed while it was copying. State traffic costs no queue space however fast it
+ * is produced, a reader that falls behind only ever sees the newest value. */
+
+#define MB_MAX_VALUE_SIZE 28							// largest mailbox value, keeps a MailboxValue at 32 bytes
+#define MB_MAILBOX_COUNT 2								// number of MailboxIDs
+
+namespace mailbox
+{
+	// one mailbox per state message and direction, the writer core initializes it. Even IDs go from the M4 to the M7,
+	// odd IDs from the M7 to the M4.
+	enum MailboxID {
+		M4toM7_LED = 0,
+		M7toM4_LED = 1
+	};
+	
+	// the value stored in a mailbox, tagged with the MessageID it would have been sent as
+	struct MailboxValue {
+		MessageID messageID;
+		uint16_t dataLen;
+		uint8_t data[MB_MAX_VALUE_SIZE];
+	} __attribute__((aligned(4)));
+	
+	
+	void init(MailboxID mailboxID);
+	
+	// returns false without writing if the reading core does not subscribe to messageID, see subscription.h
+	bool write(MailboxID mailboxID, MessageID messageID, uint16_t dataLen, const uint8_t* data);
+	
+	// copy out the mailbox value if it changed since *lastSequence and update *lastSequence, start *lastSequence at 0.
+	// Returns false if there is no new value, or if the writer kept it busy through every retry, the value is
+	// only valid when true is returned.
+	bool read(MailboxID mailboxID, uint32_t* lastSequence, MailboxValue* value);
+}
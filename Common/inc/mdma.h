@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+
+/* memory to memory copies on the master DMA controller (RM0399 15). The MDMA sits in D1 but can reach every RAM of both
+ * cores including SRAM4, the BDMA can only reach D3 so it could not copy a frame out of the M4's D2 SRAM. Each channel
+ * runs one copy at a time and calls its completion callback from MDMA_IRQHandler. The MDMA interrupt is raised on both
+ * cores, each core only handles the channels it started, so a channel must only ever be used by one core. */
+
+namespace mdma
+{
+	// channel assignments, a sending and a receiving channel per core so a send and a read can overlap
+	enum MDMA_Channel : uint8_t {
+		mdmaChannel_M4Send = 0,
+		mdmaChannel_M4Receive = 1,
+		mdmaChannel_M7Send = 2,
+		mdmaChannel_M7Receive = 3
+	};
+	
+	// called from the MDMA interrupt once the last byte of a copy has landed
+	typedef void (*Callback)(void* context);
+	
+	void init(void);								// turn on the MDMA clock, the caller enables MDMA_IRQn in its NVIC
+	bool busy(MDMA_Channel channel);				// returns true while a copy is in flight on the channel
+	
+	// start copying len bytes from src to dest and return straight away, done is called with context when the copy
+	// completes. Returns false without starting anything if the channel is busy. len must be below 64kB.
+	bool copy(MDMA_Channel channel, void* dest, const void* src, uint32_t len, Callback done, void* context);
+}
@@ -2,9 +2,22 @@
 #include <stdint.h>
 
 
+// 0xFFFF is reserved by messageQueue to mark the skipped end of its buffer
 enum MessageID:uint16_t
 {
 	NoOp = 0,
 	SetLED = 1,
-	PrintString = 2
+	PrintString = 2,
+	MetricsRequest = 3,			// ask the other core for its queue metrics, optional 1 byte payload selects one MessageQueueID
+	MetricsReport = 4,			// messageQueue::QueueMetricsReport payload, one message per queue
+	LatencyRequest = 5,			// ask the other core for its latency histograms, optional 2 byte payload selects one MessageID
+	LatencyReport = 6,			// messageQueue::LatencyReport payload, one message per MessageID
+	BlockData = 7,				// bufferPool::BlockMessage payload, the receiver frees the block once it is done with it
+	RpcRequest = 8,				// rpc::RpcHeader followed by the arguments
+	RpcResponse = 9,			// rpc::RpcHeader followed by the result
+	BenchControl = 10,			// ipcBench::BenchCase payload, starts and ends benchmark cases
+	BenchData = 11,				// benchmark traffic, the payload is only counted
+	BenchResult = 12,			// ipcBench::CaseResult payload, the receiving core's measurements of a case
+	StreamFragment = 13,		// stream::FragmentHeader followed by part of a transfer too large for one message
+	MessageIDCount				// number of MessageIDs, not a message
 };
\ No newline at end of file
@@ -3,19 +3,95 @@
 #include "hsem.h"
 #include "messageID.h"
 
-/* send messages between the two processor cores using FIFO queues with hardware semaphores to coordinate access */
+/* send messages between the two processor cores using FIFO queues. Each queue has exactly one producer core and one 
+ * consumer core, so by default the producer owns the head index and the consumer owns the tail index and memory barriers
+ * order the payload against the index updates. The original hardware semaphore locking is still available per queue. */
 
-#define MQ_MESSAGE_QUEUE_SIZE 8192						// 8kB queue going each direction
-#define MQ_MAX_MESSAGE_SIZE 1536						// max message size, 1.5kB, also max Ethernet packet size	
+#define MQ_MAX_MESSAGE_SIZE 1536						// max payload on any lane, 1.5kB, also max Ethernet packet size	
+#define MQ_LATENCY_BUCKETS 24							// log2 latency histogram buckets, the last one also counts anything longer
+#define MQ_QUEUE_COUNT 6								// number of MessageQueueIDs
+#define MQ_REGION_SIZE 32768							// length of the SRAM4_MQ region in the linker file
+#define MQ_DMA_THRESHOLD 256							// default payload size from which the async calls copy with the MDMA
 
 namespace messageQueue
 {
-	// identify which direction each of the two FIFO queues moves data
+	/* identify which direction each FIFO queue moves data. Each direction has three lanes, each with its own ring,
+	 * so control messages never queue behind bulk data. M4toM7 and M7toM4 are the normal lanes. Even IDs go from 
+	 * the M4 to the M7, odd IDs from the M7 to the M4. */
 	enum MessageQueueID {
 		M4toM7 = 0,
-		M7toM4 = 1
+		M7toM4 = 1,
+		M4toM7_Control = 2,
+		M7toM4_Control = 3,
+		M4toM7_Bulk = 4,
+		M7toM4_Bulk = 5
 	};
-
+	
+	// select how the producer and consumer coordinate access to a queue
+	enum LockMode : uint8_t {
+		LockFree = 0,									// single producer/single consumer ring, no hsem round-trip
+		HsemLocked = 1,									// also hold the queue's hardware semaphore for every send/read
+		
+		// lock-free ring that also takes sends from interrupt handlers preempting a send in progress, for events sent
+		// straight from timer or DMA interrupts. Every context claims its own room with an exclusive load/store pair and
+		// never waits for the one it interrupted, and no interrupts are masked. Messages are published in ring order,
+		// so a message sent from an interrupt becomes visible once the send it interrupted commits. Messages are
+		// counted as sent when they are reserved, and only the producer core may send on the queue.
+		MultiProducer = 2
+	};
+	
+	// what sendMessage does when the queue does not have room for the message
+	enum SendMode : uint8_t {
+		SendDrop = 0,									// give up straight away and count the message as dropped
+		SendBlock = 1,									// wait as long as it takes for the consumer to make room
+		SendBlockMillis = 2,							// wait up to timeout milliseconds, then drop the message
+		SendBlockCycles = 3								// wait up to timeout core clock cycles, then drop the message
+	};
+	
+	// result of sendMessage
+	enum SendStatus : uint8_t {
+		SendOK = 0,
+		SendDropped = 1,								// no room in the queue, counted as dropped
+		SendTimedOut = 2,								// no room before the deadline, counted as dropped
+		SendTooLarge = 3,								// larger than the queue's maximum message size, never sent
+		SendUnsubscribed = 4							// the receiving core does not handle the MessageID, never sent
+	};
+	
+	// snapshot of a queue's counters, all counts are since the producer initialized the queue
+	struct QueueMetrics {
+		uint32_t messagesSent;
+		uint32_t bytesSent;								// payload bytes, headers and wrap padding are not counted
+		uint32_t messagesRead;
+		uint32_t bytesRead;
+		uint32_t messagesDropped;						// messages sendMessage gave up on for lack of room
+		uint32_t pendingMessages;						// messages waiting to be read when the snapshot was taken
+		uint32_t bytesInQueue;							// ring bytes in use when the snapshot was taken, headers included
+		uint32_t maxPendingMessages;
+		uint32_t maxBytesInQueue;
+		uint32_t oldestMessageAge;						// microseconds the message at the front has been waiting there
+		uint32_t producerLockSpins;						// failed hsem lock attempts by the producer, HsemLocked mode only
+		uint32_t producerLockCycles;					// total producer core cycles spent holding the hsem
+		uint32_t producerMaxLockCycles;					// longest the producer held the hsem at once
+		uint32_t consumerLockSpins;
+		uint32_t consumerLockCycles;					// in the consumer core's cycles
+		uint32_t consumerMaxLockCycles;
+		uint32_t size;									// ring buffer size in bytes
+	};
+	
+	// payload of a LatencyReport message, bucket i counts messages that waited between 2^(i-1) and 2^i - 1 timebase
+	// ticks from being sent to being dispatched, bucket 0 counts zero tick waits
+	struct LatencyReport {
+		MessageID messageID;
+		uint16_t bucketCount;
+		uint32_t counts[MQ_LATENCY_BUCKETS];
+	};
+	
+	// payload of a MetricsReport message
+	struct QueueMetricsReport {
+		uint32_t msgQueueID;
+		QueueMetrics metrics;
+	};
+	
 	// defines an output buffer into which incoming messages get copied for processing
 	struct MessageQueueBufferType {
 		MessageID messageID;
@@ -23,9 +99,103 @@ namespace messageQueue
 		uint8_t data[MQ_MAX_MESSAGE_SIZE];
 	} __attribute__((packed, aligned(4)));
 	
+	// describes one message of a batch passed to sendMessages
+	struct MessageDescriptor {
+		MessageID messageID;
+		uint16_t dataLen;
+		const uint8_t* data;
+	};
+	
+	// read-only view of a message that is still sitting in the queue buffer
+	struct MessageView {
+		MessageID messageID;
+		uint16_t dataLen;
+		const uint8_t* data;							// word aligned in the queue buffer, valid until releaseMessage
+		uint32_t sendTime;								// timebase::now() when the message was sent, if hasSendTime
+		bool hasSendTime;								// the queue was initialized with timestamps
+	};
 	
-	void init(MessageQueueID msgQueueID);
+	
+	// the producer core initializes each queue. With timestamps every message carries the timebase::now() of its send in
+	// an extra 4 bytes of header, so the consumer can measure how long it waited.
+	void init(MessageQueueID msgQueueID, LockMode lockMode = LockFree, bool timestamps = false);
 	bool hasMessages(MessageQueueID msgQueueID);
-	void sendMessage(MessageQueueID msgQueueID, MessageID messageID, uint16_t dataLen, uint8_t* data);
+	
+	// the producer core initializes each queue, the consumer core should check once the producer is running that both
+	// builds were compiled with the same messageQueueLayout.h
+	bool layoutMatches(MessageQueueID msgQueueID);
+	
+	// doorbell interrupts let the consumer sleep instead of polling hasMessages. The consumer enables the doorbell once,
+	// then arms it before each sleep, armDoorbell returns false if messages are already waiting and the consumer should
+	// not sleep. The producer releases the queue's doorbell hsem after publishing if the doorbell is armed, so a burst
+	// of sends raises a single interrupt on the consumer core.
+	void enableDoorbell(MessageQueueID msgQueueID);
+	bool armDoorbell(MessageQueueID msgQueueID);
+	
+	// copy a message into the queue. When the queue is full the mode decides whether to drop the message or wait for
+	// the consumer core to make room, a blocking send never returns if the consumer is halted. Dropped messages are
+	// counted per queue so sustained overload is visible even in release builds. Messages the consumer core does not
+	// subscribe to are skipped without touching the queue, see subscription.h.
+	SendStatus sendMessage(MessageQueueID msgQueueID, MessageID messageID, uint16_t dataLen, const uint8_t* data,
+		SendMode mode = SendDrop, uint32_t timeout = 0);
+	uint32_t getDroppedMessages(MessageQueueID msgQueueID);
+	uint16_t maxPayload(MessageQueueID msgQueueID);		// largest dataLen the queue accepts once it is initialized
+	
+	// completion callback of the async calls, called from the MDMA interrupt, or before returning for a CPU copy
+	typedef void (*AsyncCallback)(MessageQueueID msgQueueID, void* context);
+	
+	// send without waiting for the payload copy. Payloads of at least the DMA threshold are copied into the queue by the
+	// MDMA and published from its interrupt once the copy has landed, so the caller keeps running while a large frame
+	// moves. Smaller payloads, or any payload while this core's MDMA channel is busy, are copied by the CPU and published
+	// before returning. data must not change until done is called. The queue stays reserved while the copy is in
+	// flight, other sends on it find no room until it is published. On a MultiProducer queue other sends carry on but
+	// are only published after the copy, and a second async send is dropped.
+	SendStatus sendMessageAsync(MessageQueueID msgQueueID, MessageID messageID, uint16_t dataLen, const uint8_t* data,
+		AsyncCallback done = 0, void* context = 0);
+	void setDmaThreshold(uint32_t bytes);
+	
+	// read the queue's counters out of shared memory, either core can take a snapshot of any queue at any time
+	void getMetrics(MessageQueueID msgQueueID, QueueMetrics* metrics);
+	
+	// zero-copy send, reserve room for a message and get a pointer to its payload directly in the queue buffer, write
+	// dataLen bytes there and then commit to publish it. The payload is word aligned so it can be filled in as a struct.
+	// Returns 0 if the queue does not have room. Only one message can be reserved per queue at a time, and in HsemLocked
+	// mode the hardware semaphore is held until the commit. See LockMode for reserving from interrupts on MultiProducer.
+	uint8_t* reserveMessage(MessageQueueID msgQueueID, MessageID messageID, uint16_t dataLen);
+	
+	// reserve the way sendMessage would send, waiting for room or counting a drop according to the mode, and skipping
+	// messages the consumer core does not subscribe to. Returns 0 with the reason in *status if there is no
+	// reservation to fill in. The other reserveMessage and sendMessages do not check subscriptions.
+	uint8_t* reserveMessage(MessageQueueID msgQueueID, MessageID messageID, uint16_t dataLen, SendMode mode,
+		uint32_t timeout, SendStatus* status);
+	void commitMessage(MessageQueueID msgQueueID);
+	
+	// send a burst of messages with a single lock acquisition and a single head update. The batch is all-or-nothing,
+	// returns false without writing anything if the queue does not have room for every message.
+	bool sendMessages(MessageQueueID msgQueueID, const MessageDescriptor* messages, uint32_t count);
+	
 	void readMessage(MessageQueueID msgQueueID, MessageQueueBufferType* buffer);
+	
+	// read the next message into buffer the same way as sendMessageAsync, large payloads are copied out by the MDMA and
+	// the message is released from its interrupt. Returns false if the queue is empty or a copy out of it is still in
+	// flight, peekMessage also finds nothing until then.
+	bool readMessageAsync(MessageQueueID msgQueueID, MessageQueueBufferType* buffer, AsyncCallback done = 0,
+		void* context = 0);
+	
+	// zero-copy receive, get a view of the next message in place in the queue buffer and release it once it has been
+	// handled. Records never straddle the end of the buffer so the payload is always contiguous, and it is word aligned
+	// so it can be read directly as a struct. peekMessage returns false if the queue is empty, in HsemLocked mode the
+	// hardware semaphore is held until the release.
+	bool peekMessage(MessageQueueID msgQueueID, MessageView* view);
+	void releaseMessage(MessageQueueID msgQueueID);
+	
+	// histogram bucket for a send to dispatch delay in timebase ticks, shared so both cores bucket the same way
+	uint32_t latencyBucket(uint32_t ticks);
+	
+	// word-at-a-time copy used for everything moved in and out of the shared SRAM4 buffers
+	void copyBytes(uint8_t* dest, const uint8_t* src, uint32_t len);
+	
+	// the queue's ring buffer in SRAM4 and its capacity, for timing copies across the D3 bus. The consumer never reads
+	// outside the pending messages, so the producer core may scribble over the ring while nothing is queued or reserved.
+	uint8_t* ringStorage(MessageQueueID msgQueueID, uint32_t* size);
 }
\ No newline at end of file
@@ -0,0 +1,172 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "hsem.h"
+#include "messageQueue.h"
+#include "mailbox.h"
+#include "bufferPool.h"
+#include "subscription.h"
+
+/* Shared memory layout of the message queues, mailboxes, subscriptions and buffer pools in the SRAM4_MQ region. Both cores compile this header, so
+ * the size of every queue is fixed here at compile time and the M4 and M7 builds always agree on where each queue lives.
+ * To resize a lane change its MessageQueue template arguments in MessageQueueLayout.
+ * 
+ * The M7 has a data cache and the M4 does not. Everything one core writes is kept on cache lines of its own, so the M7
+ * can clean the lines it wrote and invalidate the lines the M4 wrote without ever throwing away its own writes. With
+ * MQ_M7_DCACHE the M7 keeps SRAM4_MQ write-back cacheable and does this maintenance by address, without it the M7's MPU
+ * has to map the region as non-cacheable. */
+
+#define MQ_CACHE_LINE_SIZE 32							// M7 data cache line size
+#define MQ_MAX_HEADER_SIZE 8							// most a record spends in front of its payload, with a timestamp
+#ifndef MQ_M7_DCACHE
+#define MQ_M7_DCACHE 1									// M7 cleans/invalidates SRAM4_MQ lines instead of relying on the MPU
+#endif
+
+// start of the 32kB SRAM4_MQ region, defined in the linker file of both cores
+extern void* _sram4_mq;
+
+namespace messageQueue
+{
+	// hardware semaphore contention seen by one side of a queue, only counted in HsemLocked mode. Cycles are counted by
+	// the DWT of the core that took the lock, so the producer and consumer sides may be in different clock rates.
+	struct LockMetrics {
+		uint32_t spins;							// failed attempts to take the hsem
+		uint32_t holdCycles;					// total cycles the hsem was held
+		uint32_t maxHoldCycles;					// longest the hsem was held at once
+		uint32_t lockedAt;						// cycle count when the hsem was last taken
+	};
+	
+	// control block at the front of every queue, each group of fields starts on its own cache line
+	struct MessageQueueControl {
+		// written only by the producer core
+		volatile uint32_t head __attribute__((aligned(MQ_CACHE_LINE_SIZE)));	// free-running byte index where the next byte should be written
+		volatile uint32_t messagesSent;			// the number of messages ever published to the queue
+		volatile uint32_t reservedHead;			// head index after the reserved but not yet committed messages
+		uint32_t maxPendingMessages;			// the largest number of pending messages ever in the queue at once
+		uint32_t maxBytesInQueue;				// the largest number of bytes ever contained in the queue
+		volatile uint32_t doorbellRung;			// the value of doorbellArmed when the producer last rang the doorbell
+		volatile uint32_t messagesDropped;		// the number of messages sendMessage gave up on for lack of room
+		volatile uint32_t bytesSent;			// the number of payload bytes ever published to the queue
+		uint32_t reservedBytes;					// payload bytes of the reserved but not yet committed messages
+		volatile uint32_t frontSince;			// timebase::now() when a message was published into an empty queue
+		LockMetrics producerLock;				// hsem contention while sending
+		volatile uint32_t activeProducers;		// contexts between reserving and committing, MultiProducer mode only
+		
+		// written only by the consumer core
+		volatile uint32_t tail __attribute__((aligned(MQ_CACHE_LINE_SIZE)));	// free-running byte index where the next byte should be read
+		volatile uint32_t messagesRead;			// the number of messages ever removed from the queue
+		uint32_t peekedTail;					// tail index after the peeked but not yet released message
+		volatile uint32_t doorbellArmed;		// incremented by the consumer to ask for a doorbell on the next message
+		volatile uint32_t bytesRead;			// the number of payload bytes ever removed from the queue
+		uint32_t peekedBytes;					// payload bytes of the peeked but not yet released message
+		volatile uint32_t releasedAt;			// timebase::now() when the consumer last released a message
+		LockMetrics consumerLock;				// hsem contention while reading
+		
+		// fixed when the queue is initialized, written by the producer core
+		uint32_t layoutKey __attribute__((aligned(MQ_CACHE_LINE_SIZE)));	// layout of the producer's build, checked by the consumer core
+		uint32_t size;							// number of bytes in the buffer
+		uint32_t mask;							// size - 1, wraps a free-running index to a buffer offset
+		uint32_t maxMessageSize;				// largest record, header included, that may be sent on this queue
+		uint32_t headerSize;					// bytes in front of each payload, more when messages carry a timestamp
+		hsem::HSEM_ID hsemID;					// hardware semaphore controlling access to this queue
+		hsem::HSEM_ID doorbellID;				// hardware semaphore released to interrupt the consumer core
+		LockMode lockMode;						// whether the hardware semaphore is taken for every send/read
+	} __attribute__((aligned(MQ_CACHE_LINE_SIZE)));
+	
+	// a queue is its control block immediately followed by a Capacity byte ring buffer
+	template <uint32_t Capacity, uint32_t MaxMessage>
+	struct MessageQueue {
+		// head and tail are free-running 32-bit indices, they only wrap cleanly if the capacity divides 2^32
+		static_assert((Capacity >= 4) && ((Capacity & (Capacity - 1)) == 0), "message queue capacity must be a power of two");
+		static_assert(MaxMessage <= Capacity, "message queue must be able to hold its largest message");
+		static_assert(MaxMessage <= (MQ_MAX_MESSAGE_SIZE + 4), "messages must fit in a MessageQueueBufferType");
+		
+		static constexpr uint32_t capacity = Capacity;
+		static constexpr uint32_t mask = Capacity - 1;
+		static constexpr uint32_t maxMessageSize = MaxMessage;
+		
+		MessageQueueControl control;
+		uint8_t buffer[Capacity] __attribute__((aligned(MQ_CACHE_LINE_SIZE)));	// line aligned so the ring shares no line with the control block
+	};
+	
+	// a mailbox value guarded by its sequence counter, which is odd while the writer is updating the value. Mailboxes
+	// written by different cores must not share a cache line.
+	struct MailboxSlot {
+		volatile uint32_t sequence;
+		mailbox::MailboxValue value;
+	} __attribute__((aligned(MQ_CACHE_LINE_SIZE)));
+	
+	// the MessageIDs one core handles, written only by that core once the M4 has cleared it at boot
+	struct SubscriptionTable {
+		volatile uint32_t published;			// 0 until the core has subscribed to everything it handles
+		volatile uint32_t bits[SUB_MAX_MESSAGE_IDS / 32];	// bit n % 32 of word n / 32 is set if the core handles MessageID n
+	} __attribute__((aligned(MQ_CACHE_LINE_SIZE)));
+	
+	// control block at the front of every buffer pool, the allocating core owns the blocks until it sends them and the
+	// receiving core hands them back through the return ring
+	struct BufferPoolControl {
+		// written only by the allocating core
+		uint32_t freeMask __attribute__((aligned(MQ_CACHE_LINE_SIZE)));	// one bit per block that alloc may hand out
+		volatile uint32_t returnTail;			// free-running index of the next returned block to take back
+		uint32_t blocksAllocated;				// the number of blocks ever handed out by alloc
+		uint32_t allocFailures;					// the number of times alloc found every block in use
+		uint32_t heldMask;						// one bit per block handed out by alloc and not sent yet
+		volatile uint32_t sentFlips;			// bit n flips every time block n is sent to the receiving core
+		
+		// written only by the receiving core
+		volatile uint32_t returnHead __attribute__((aligned(MQ_CACHE_LINE_SIZE)));	// free-running index where the next freed block goes
+		volatile uint8_t returnRing[BP_MAX_BLOCKS];	// indices of freed blocks, never more than blockCount in flight
+		volatile uint32_t freedFlips;			// bit n flips every time block n is freed here, it is held here while it differs from sentFlips
+		
+		// fixed when the pool is initialized, written by the allocating core
+		uint32_t blockCount __attribute__((aligned(MQ_CACHE_LINE_SIZE)));
+		uint32_t blockSize;
+	} __attribute__((aligned(MQ_CACHE_LINE_SIZE)));
+	
+	// a pool is its control block immediately followed by BlockCount blocks of BlockSize bytes
+	template <uint32_t BlockCount, uint32_t BlockSize>
+	struct BufferPool {
+		// the return ring is indexed with a mask, and each block must start and end on a cache line of its own
+		static_assert((BlockCount > 0) && (BlockCount <= BP_MAX_BLOCKS) && ((BlockCount & (BlockCount - 1)) == 0), "buffer pool block count must be a power of two up to BP_MAX_BLOCKS");
+		static_assert((BlockSize % MQ_CACHE_LINE_SIZE) == 0, "buffer pool blocks must be whole cache lines");
+		
+		static constexpr uint32_t blockCount = BlockCount;
+		static constexpr uint32_t blockSize = BlockSize;
+		
+		BufferPoolControl control;
+		uint8_t blocks[BlockCount][BlockSize] __attribute__((aligned(MQ_CACHE_LINE_SIZE)));
+	};
+	
+	// every queue in the SRAM4_MQ region, one member per MessageQueueID, followed by the mailboxes, the subscriptions
+	// of the M4 and the M7 and one buffer pool member per PoolID
+	struct MessageQueueLayout {
+		MessageQueue<4096, 1536> m4toM7;		// normal lane, max message size is also the max Ethernet packet size
+		MessageQueue<4096, 1536> m7toM4;
+		MessageQueue<1024, 128> m4toM7_Control;	// control messages are small so they never wait long for room
+		MessageQueue<1024, 128> m7toM4_Control;
+		MessageQueue<4096, 1536> m4toM7_Bulk;	// bulk data lane
+		MessageQueue<4096, 1536> m7toM4_Bulk;
+		MailboxSlot mailboxes[MB_MAILBOX_COUNT];
+		SubscriptionTable subscriptions[2];		// what the M4 handles, then what the M7 handles
+		BufferPool<4, BP_BLOCK_SIZE> m4toM7_Pool;	// frames handed over by reference, see bufferPool.h
+		BufferPool<4, BP_BLOCK_SIZE> m7toM4_Pool;
+	};
+	
+	static_assert(sizeof(MessageQueueLayout) <= MQ_REGION_SIZE, "message queues do not fit in the SRAM4_MQ region");
+	
+	
+	// data cache maintenance on the M7 for a range of the shared region, clean after writing and invalidate before reading
+	// memory the other core writes. The range is widened to whole cache lines. Both do nothing on the M4 or without
+	// MQ_M7_DCACHE.
+	void cleanShared(const volatile void* addr, uint32_t len);
+	void invalidateShared(const volatile void* addr, uint32_t len);
+	
+	// start of the SRAM4_MQ region. gcc takes the _sram4_mq linker symbol for an 8 byte object and warns about every
+	// access past that, so the address goes through an empty asm that hides where it came from.
+	inline uint8_t* regionBase(void)
+	{
+		uint8_t* base = (uint8_t*)&_sram4_mq;
+		__asm__("" : "+r"(base));
+		return base;
+	}
+}
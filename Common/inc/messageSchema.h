@@ -0,0 +1,83 @@
+#pragma once
+#include <stdint.h>
+#include <type_traits>
+#include "messageID.h"
+#include "messageQueue.h"
+#include "messageQueueLayout.h"
+#include "bufferPool.h"
+#include "ipcBench.h"
+
+/* compile-time payload types for the MessageIDs whose payload is a fixed struct. Both cores compile these bindings, so
+ * a typed message is sent as a single struct assignment straight into the queue buffer and read in place on the other
+ * side, with no packing code. MessageIDs with variable length payloads (PrintString, the requests with optional
+ * selectors, rpc) have no binding and keep using the byte API. Messages sent on a fixed lane name it as a template
+ * argument too, so a payload too large for that lane fails to compile instead of returning SendTooLarge. */
+
+// bind a MessageID to its payload type, payloads are stored word aligned so any type up to word alignment works
+#define MQ_MESSAGE_PAYLOAD(id, T) template <> struct MessagePayload<id> { \
+	typedef T type; \
+	static_assert(std::is_trivially_copyable<T>::value, "message payloads must be trivially copyable"); \
+	static_assert(sizeof(T) <= MQ_MAX_MESSAGE_SIZE, "message payload larger than MQ_MAX_MESSAGE_SIZE"); \
+	static_assert(alignof(T) <= 4, "message payloads are only word aligned in the queue buffer"); }
+
+// the largest payload a lane takes whether or not it carries timestamps, from the lane's member of the layout
+#define MQ_LANE_PAYLOAD(lane, member) template <> struct LanePayload<lane> { \
+	static constexpr uint32_t maxSize = decltype(MessageQueueLayout::member)::maxMessageSize - MQ_MAX_HEADER_SIZE; }
+
+namespace messageQueue
+{
+	// the payload type of each MessageID, only the bound ones below can be sent with send<>
+	template <MessageID ID> struct MessagePayload;
+	
+	MQ_MESSAGE_PAYLOAD(SetLED, uint32_t);
+	MQ_MESSAGE_PAYLOAD(MetricsReport, QueueMetricsReport);
+	MQ_MESSAGE_PAYLOAD(::LatencyReport, LatencyReport);
+	MQ_MESSAGE_PAYLOAD(BlockData, bufferPool::BlockMessage);
+	MQ_MESSAGE_PAYLOAD(BenchControl, ipcBench::BenchCase);
+	MQ_MESSAGE_PAYLOAD(BenchResult, ipcBench::CaseResult);
+	
+	// the largest payload of each lane, for sends on a lane known at compile time
+	template <MessageQueueID Lane> struct LanePayload;
+	
+	MQ_LANE_PAYLOAD(M4toM7, m4toM7);
+	MQ_LANE_PAYLOAD(M7toM4, m7toM4);
+	MQ_LANE_PAYLOAD(M4toM7_Control, m4toM7_Control);
+	MQ_LANE_PAYLOAD(M7toM4_Control, m7toM4_Control);
+	MQ_LANE_PAYLOAD(M4toM7_Bulk, m4toM7_Bulk);
+	MQ_LANE_PAYLOAD(M7toM4_Bulk, m7toM4_Bulk);
+	
+	
+	// send a typed message, the payload is written into the queue as one struct assignment
+	template <MessageID ID>
+	SendStatus send(MessageQueueID msgQueueID, const typename MessagePayload<ID>::type& payload, SendMode mode = SendDrop,
+		uint32_t timeout = 0)
+	{
+		typedef typename MessagePayload<ID>::type T;
+		SendStatus status;
+		T* slot = (T*)reserveMessage(msgQueueID, ID, sizeof(T), mode, timeout, &status);
+		if (slot != 0) {
+			*slot = payload;
+			commitMessage(msgQueueID);
+		}
+		return status;
+	}
+	
+	// send a typed message on a lane known at compile time, checking the payload against the lane's largest message
+	template <MessageID ID, MessageQueueID Lane>
+	SendStatus send(const typename MessagePayload<ID>::type& payload, SendMode mode = SendDrop, uint32_t timeout = 0)
+	{
+		static_assert(sizeof(typename MessagePayload<ID>::type) <= LanePayload<Lane>::maxSize, "message payload too large for the lane");
+		return send<ID>(Lane, payload, mode, timeout);
+	}
+	
+	// the typed payload of a message read in place, valid until the message is released. Returns 0 if the message is
+	// not of that MessageID or its length does not match the type, which only happens if the cores disagree on the
+	// schema.
+	template <MessageID ID>
+	const typename MessagePayload<ID>::type* payload(const MessageView* msg)
+	{
+		typedef typename MessagePayload<ID>::type T;
+		if ((msg->messageID != ID) || (msg->dataLen != sizeof(T))) { return 0; }
+		return (const T*)msg->data;
+	}
+}
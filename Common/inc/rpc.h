@@ -0,0 +1,58 @@
+#pragma once
+#include <stdint.h>
+#include "messageQueue.h"
+
+/* request/response calls between the cores on top of the message queues. A call sends an RpcRequest message tagged
+ * with a correlation ID and returns straight away, the other core runs the registered handler for the method and
+ * sends back an RpcResponse with the same ID, which completes the call through its callback. Up to RPC_MAX_PENDING
+ * calls can be outstanding at once, calls that get no response within their timeout complete with RpcTimedOut.
+ * Both cores have to pass RpcRequest and RpcResponse messages to handleMessage and call update regularly. */
+
+#define RPC_MAX_PENDING 16								// outstanding calls per core, a power of two
+#define RPC_SLOT_BITS 4									// log2(RPC_MAX_PENDING)
+
+namespace rpc
+{
+	// every method either core can call on the other, a core only answers the methods it registered a handler for
+	enum RpcMethod : uint16_t {
+		rpcMethod_Ping = 0,								// returns its arguments, registered on both cores by init
+		rpcMethodCount									// number of RpcMethods, not a method
+	};
+	
+	// how a call completed
+	enum RpcStatus : uint8_t {
+		RpcOK = 0,
+		RpcTimedOut = 1,								// no response before the deadline, a late one is ignored
+		RpcUnknownMethod = 2,							// the other core has no handler for the method
+		RpcFailed = 3									// the handler failed, or its result did not fit the reply lane
+	};
+	
+	// header at the front of every RpcRequest and RpcResponse payload, followed by the arguments or the result
+	struct RpcHeader {
+		uint32_t correlationID;							// chosen by the caller, never 0
+		RpcMethod method;
+		RpcStatus status;								// only used in responses
+		uint8_t replyLane;								// MessageQueueID the response is sent back on
+	};
+	
+	// runs on the called core, fills in up to resultCapacity bytes of result and sets *resultLen
+	typedef RpcStatus (*Handler)(const uint8_t* args, uint16_t argsLen, uint8_t* result, uint16_t resultCapacity,
+		uint16_t* resultLen);
+	
+	// runs on the calling core when the call completes, result is only valid during the callback
+	typedef void (*Callback)(RpcStatus status, const uint8_t* result, uint16_t resultLen, void* context);
+	
+	
+	void init(void);
+	void registerMethod(RpcMethod method, Handler handler);
+	
+	// call a method on the other core with the request sent on lane and the response coming back on the matching lane
+	// in the other direction. Returns the call's correlation ID, or 0 if RPC_MAX_PENDING calls are already
+	// outstanding or the request could not be sent, in which case done is never called.
+	uint32_t call(messageQueue::MessageQueueID lane, RpcMethod method, const uint8_t* args, uint16_t argsLen,
+		uint32_t timeoutMillis, Callback done, void* context);
+	
+	void handleMessage(const messageQueue::MessageView* msg);	// pass every RpcRequest and RpcResponse here
+	void update(void);											// completes calls whose deadline has passed
+	uint32_t pendingCalls(void);
+}
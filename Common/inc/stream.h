@@ -0,0 +1,67 @@
+#pragma once
+#include <stdint.h>
+#include "messageQueue.h"
+
+/* transfers larger than a queue message, such as sample captures, firmware chunks and log dumps. The sender splits a
+ * transfer into StreamFragment messages as large as the lane allows, each with a header giving its transfer and its
+ * offset, and writes them into the ring as fast as room frees up, so the receiver is already consuming the first
+ * fragments while later ones are written. The receiver copies the fragments of a transfer into one of a fixed number
+ * of reassembly buffers and hands the whole transfer over once the last one arrives, a transfer that fits in a single
+ * fragment is handed over in place. Fragments of a lane arrive in order, a transfer that finds no free buffer or
+ * stops arriving is dropped and counted. Both cores pass StreamFragment messages to handleMessage and call update
+ * regularly. The buffers are sized at build time, a core that only sends streams sets STREAM_REASSEMBLY_BUFFERS to 0
+ * and links none of them, it still takes transfers that fit in a single fragment. The defaults below are overridden
+ * per core with a -D or in the core's system.h, which stream.cpp includes. */
+
+#ifndef STREAM_MAX_TRANSFER_SIZE
+#define STREAM_MAX_TRANSFER_SIZE 16384					// largest transfer, also the size of each reassembly buffer
+#endif
+#ifndef STREAM_REASSEMBLY_BUFFERS
+#define STREAM_REASSEMBLY_BUFFERS 2						// transfers that can be in reassembly at once
+#endif
+#ifndef STREAM_TIMEOUT_MILLIS
+#define STREAM_TIMEOUT_MILLIS 100						// a transfer with no new fragment for this long is dropped
+#endif
+
+namespace stream
+{
+	// at the front of every StreamFragment payload, followed by the fragment's bytes of the transfer
+	struct FragmentHeader {
+		uint32_t transferID;							// chosen by the sender, never 0
+		uint32_t totalLen;								// bytes in the whole transfer
+		uint32_t offset;								// where this fragment's bytes go in the transfer
+		uint16_t channel;								// what the transfer is, for the receiver
+		uint16_t reserved;
+	};
+	
+	// counts since init on this core
+	struct StreamStats {
+		uint32_t transfersSent;							// last fragment written to the ring
+		uint32_t fragmentsSent;
+		uint32_t transfersReceived;						// handed over complete
+		uint32_t fragmentsReceived;
+		uint32_t transfersDropped;						// no free reassembly buffer or larger than STREAM_MAX_TRANSFER_SIZE
+		uint32_t transfersAborted;						// a fragment was missing or the rest timed out
+	};
+	
+	// runs on the sending core once the last fragment is in the ring and data may be reused
+	typedef void (*SendCallback)(uint32_t transferID, void* context);
+	
+	// runs on the receiving core for every complete transfer, data is only valid during the call
+	typedef void (*ReceiveCallback)(uint16_t channel, const uint8_t* data, uint32_t len);
+	
+	
+	void init(ReceiveCallback receiver);
+	
+	// start sending len bytes on lane, as many fragments as fit are written before returning and update writes the
+	// rest. data must not change until done is called. One transfer at a time per lane, returns the transfer's ID or
+	// 0 if the lane is still busy with the last one, the transfer is too large or the other core does not subscribe to
+	// StreamFragment.
+	uint32_t send(messageQueue::MessageQueueID lane, uint16_t channel, const uint8_t* data, uint32_t len,
+		SendCallback done = 0, void* context = 0);
+	bool sending(messageQueue::MessageQueueID lane);
+	
+	void handleMessage(const messageQueue::MessageView* msg);	// pass every StreamFragment here
+	void update(void);											// writes pending fragments, drops stalled reassembly
+	const StreamStats* getStats(void);
+}
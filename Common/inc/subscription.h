@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include "hsem.h"
+#include "messageID.h"
+
+/* which MessageIDs each core actually handles, so the other core does not spend ring space and its own time on
+ * messages that would only be dropped on arrival. Every core keeps a bitmap of the MessageIDs it subscribes to in
+ * SRAM4 next to the message queues, only that core writes it. sendMessage, send<> and mailbox::write check the
+ * receiving core's bitmap first and skip a message nobody subscribes to, callers that build an expensive payload can
+ * check subscribed themselves before building it. Until a core publishes its subscriptions everything is sent to it,
+ * so a core built without subscriptions still gets every message. */
+
+#define SUB_MAX_MESSAGE_IDS 64							// MessageIDs the bitmaps have room for, a multiple of 32
+
+namespace subscription
+{
+	// the M4 boots first and marks both cores' subscriptions unknown, before starting the M7
+	void reset(void);
+	
+	// the receiving side, this core's subscriptions. Subscribe to everything this core handles, then publish once so
+	// the other core starts skipping the rest, later changes take effect straight away.
+	void subscribe(MessageID messageID);
+	void unsubscribe(MessageID messageID);
+	void publish(void);
+	
+	// the sending side, true if the receiving core handles messageID or has not published its subscriptions yet
+	bool subscribed(hsem::Core_ID receiver, MessageID messageID);
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+
+/* free-running clock that reads the same on both cores, used to time how long messages wait in the queues. The DWT
+ * cycle counters of the two cores run at different rates and start at different times, so anything compared across
+ * cores uses this instead. It ticks at the 200MHz M4 clock rate, the 32-bit count wraps after about 21 seconds so only
+ * compare differences. */
+
+#define TB_TIMER_CLOCK_HZ 200000000						// TIM2 kernel clock, twice the 100MHz APB1 clock
+#define TB_TICKS_PER_SECOND TB_TIMER_CLOCK_HZ			// count every timer clock, the same rate as the M4 DWT
+#define TB_TICKS_PER_MICROSECOND (TB_TICKS_PER_SECOND / 1000000)
+
+namespace timebase
+{
+	void init(void);									// called once by the M4 before it starts the M7
+	uint32_t now(void);
+	
+	// this core's own millisecond tick and clock cycle count, for timeouts and for timing code on one core. They are
+	// defined by each core's system code so the Common code does not call into either core's sys4, and like the DWT
+	// counter they can not be compared across cores.
+	uint32_t localMillis(void);
+	uint32_t localCycles(void);
+	inline uint32_t localMillisSince(uint32_t start) { return localMillis() - start; }
+}
@@ -0,0 +1,238 @@
+#include "../inc/bufferPool.h"
+#include "../inc/messageQueueLayout.h"
+#include "../inc/stm32h745xx.h"
+#include "../inc/stm32h7xx.h"
+#include "../M4/Code/sys/system.h"
+#include <string.h>
+
+using namespace bufferPool;
+using namespace messageQueue;
+using namespace hsem;
+
+
+// where each pool lives in the layout and the shape of its blocks, indexed by PoolID
+struct PoolConfig {
+	uint32_t offset;
+	uint32_t blockCount;
+	uint32_t blockSize;
+};
+
+#define BP_POOL_CONFIG(member) { offsetof(MessageQueueLayout, member), \
+	decltype(MessageQueueLayout::member)::blockCount, decltype(MessageQueueLayout::member)::blockSize }
+
+static constexpr PoolConfig poolConfig[BP_POOL_COUNT] = {
+	BP_POOL_CONFIG(m4toM7_Pool),
+	BP_POOL_CONFIG(m7toM4_Pool)
+};
+
+// the blocks are found right after the control block
+static_assert(offsetof(decltype(MessageQueueLayout::m4toM7_Pool), blocks) == sizeof(BufferPoolControl), "pool blocks must follow their control block");
+
+// a handle is the PoolID plus one in its second byte and the block index in its first, so 0 is never a valid handle
+#define BP_HANDLE(poolID, index) ((((uint32_t)(poolID) + 1) << 8) | (index))
+#define BP_HANDLE_POOL(handle) (((handle) >> 8) - 1)
+#define BP_HANDLE_INDEX(handle) ((handle) & 0xFF)
+
+// the pools live in the SRAM4_MQ region after the subscriptions, see messageQueueLayout.h
+static BufferPoolControl* pool(uint32_t poolID)
+{
+	return (BufferPoolControl*)(regionBase() + poolConfig[poolID].offset);
+}
+
+static uint8_t* block(uint32_t poolID, uint32_t index)
+{
+	// the shape of the pool is known at compile time, so the receiving core never has to read the control block
+	return (uint8_t*)(pool(poolID) + 1) + (index * poolConfig[poolID].blockSize);
+}
+
+static bool localAllocator(uint32_t poolID)
+{
+	// the sending core allocates, even PoolIDs are sent by the M4
+	return ((poolID & 1) == 0) == (localCoreID == m4_coreID);
+}
+
+// BlockMessages receiveBlock refused on this core
+static uint32_t rejectedBlocks;
+
+static bool validHandle(BlockHandle handle);
+static void takeBackReturned(uint32_t poolID);
+
+
+void bufferPool::init(PoolID poolID)
+{
+	BufferPoolControl* p = pool(poolID);
+	
+	// every block starts out free
+	memset(p, 0, sizeof(BufferPoolControl));
+	uint32_t blockCount = poolConfig[poolID].blockCount;
+	p->freeMask = (blockCount == 32) ? 0xFFFFFFFFUL : ((1UL << blockCount) - 1);
+	p->blockCount = blockCount;
+	p->blockSize = poolConfig[poolID].blockSize;
+	cleanShared(p, sizeof(BufferPoolControl));
+}
+
+
+BlockHandle bufferPool::alloc(PoolID poolID)
+{
+	BufferPoolControl* p = pool(poolID);
+	
+	if (!localAllocator(poolID)) { SYS_ERROR("buffer pool allocated by the wrong core"); }
+	
+	// only look at the return ring once the blocks we know about have run out
+	if (p->freeMask == 0) { takeBackReturned(poolID); }
+	if (p->freeMask == 0) {
+		p->allocFailures++;
+		return 0;
+	}
+	
+	uint32_t index = 31 - __CLZ(p->freeMask);
+	p->freeMask &= ~(1UL << index);
+	p->heldMask |= (1UL << index);
+	p->blocksAllocated++;
+	return BP_HANDLE(poolID, index);
+}
+
+
+uint8_t* bufferPool::data(BlockHandle handle)
+{
+	if (!validHandle(handle)) {
+		SYS_ERROR("invalid buffer pool handle: 0x%lx", (unsigned long)handle);
+		return 0;
+	}
+	return block(BP_HANDLE_POOL(handle), BP_HANDLE_INDEX(handle));
+}
+
+
+uint32_t bufferPool::freeBlocks(PoolID poolID)
+{
+	BufferPoolControl* p = pool(poolID);
+	
+	if (!localAllocator(poolID)) { SYS_ERROR("buffer pool checked by the wrong core"); }
+	
+	takeBackReturned(poolID);
+	return __builtin_popcount(p->freeMask);
+}
+
+
+SendStatus bufferPool::sendBlock(MessageQueueID msgQueueID, MessageID messageID, BlockHandle handle, uint16_t dataLen,
+	SendMode mode, uint32_t timeout)
+{
+	uint8_t* d = data(handle);
+	uint32_t poolID = BP_HANDLE_POOL(handle);
+	uint32_t bit = 1UL << BP_HANDLE_INDEX(handle);
+	BufferPoolControl* p = pool(poolID);
+	if (!localAllocator(poolID) || !(p->heldMask & bit)) {
+		SYS_ERROR("buffer pool block sent without being held: 0x%lx", (unsigned long)handle);
+		return SendTooLarge;
+	}
+	if (dataLen > poolConfig[poolID].blockSize) { return SendTooLarge; }
+	
+	// the receiver reads the block straight out of SRAM4, the queue publish orders these bytes and the flipped sent
+	// bit before the message. The block is the receiver's once the message can be seen, so it only goes back to
+	// being ours if the send fails.
+	cleanShared(d, dataLen);
+	p->heldMask &= ~bit;
+	p->sentFlips ^= bit;
+	cleanShared(&p->sentFlips, sizeof(p->sentFlips));
+	BlockMessage msg = { handle, dataLen };
+	SendStatus status = sendMessage(msgQueueID, messageID, sizeof(msg), (const uint8_t*)&msg, mode, timeout);
+	if (status != SendOK) {
+		p->sentFlips ^= bit;
+		cleanShared(&p->sentFlips, sizeof(p->sentFlips));
+		p->heldMask |= bit;
+	}
+	return status;
+}
+
+
+const uint8_t* bufferPool::receiveBlock(const BlockMessage* msg)
+{
+	// only blocks of the other core's pool can arrive here, freeing one of our own would put it straight back into
+	// the free mask while the other core may still think it holds it
+	uint32_t poolID = BP_HANDLE_POOL(msg->handle);
+	if (!validHandle(msg->handle) || localAllocator(poolID) || (msg->dataLen > poolConfig[poolID].blockSize)) {
+		rejectedBlocks++;
+		return 0;
+	}
+	
+	// drop anything the M7 still has cached from the last time it saw this block
+	uint8_t* d = block(poolID, BP_HANDLE_INDEX(msg->handle));
+	invalidateShared(d, msg->dataLen);
+	return d;
+}
+
+
+uint32_t bufferPool::getRejectedBlocks(void)
+{
+	return rejectedBlocks;
+}
+
+
+void bufferPool::free(BlockHandle handle)
+{
+	if (!validHandle(handle)) {
+		SYS_ERROR("invalid buffer pool handle: 0x%lx", (unsigned long)handle);
+		return;
+	}
+	uint32_t poolID = BP_HANDLE_POOL(handle);
+	uint32_t index = BP_HANDLE_INDEX(handle);
+	uint32_t bit = 1UL << index;
+	BufferPoolControl* p = pool(poolID);
+	
+	// a block that was never sent goes straight back into the free mask
+	if (localAllocator(poolID)) {
+		if (!(p->heldMask & bit)) {
+			SYS_ERROR("buffer pool block freed twice or after sending: 0x%lx", (unsigned long)handle);
+			return;
+		}
+		p->heldMask &= ~bit;
+		p->freeMask |= bit;
+		return;
+	}
+	
+	// the receiving core holds the block while its sent and freed bits differ, the sending core cannot flip the sent
+	// bit again until the block is back in its pool
+	invalidateShared(&p->sentFlips, sizeof(p->sentFlips));
+	if (!((p->sentFlips ^ p->freedFlips) & bit)) {
+		SYS_ERROR("buffer pool block freed twice or never received: 0x%lx", (unsigned long)handle);
+		return;
+	}
+	p->freedFlips ^= bit;
+	
+	// the receiving core pushes the index onto the return ring, which cannot overflow because it has a slot for
+	// every block and only blocks that were handed out are ever pushed
+	uint32_t head = p->returnHead;
+	p->returnRing[head & (poolConfig[poolID].blockCount - 1)] = index;
+	cleanShared(&p->returnRing[head & (poolConfig[poolID].blockCount - 1)], 1);
+	
+	// make sure the index lands before the allocating core can see the new head
+	__DMB();
+	p->returnHead = head + 1;
+	cleanShared(&p->returnHead, sizeof(p->returnHead));
+}
+
+
+bool validHandle(BlockHandle handle)
+{
+	uint32_t poolID = BP_HANDLE_POOL(handle);
+	return (poolID < BP_POOL_COUNT) && (BP_HANDLE_INDEX(handle) < poolConfig[poolID].blockCount);
+}
+
+
+void takeBackReturned(uint32_t poolID)
+{
+	BufferPoolControl* p = pool(poolID);
+	
+	// move every block the receiving core has freed since last time back into the free mask
+	invalidateShared(&p->returnHead, sizeof(p->returnHead) + sizeof(p->returnRing));
+	uint32_t head = p->returnHead;
+	
+	// make sure the head index is read before the ring entries it covers
+	__DMB();
+	uint32_t tail = p->returnTail;
+	while (tail != head) {
+		p->freeMask |= (1UL << p->returnRing[tail & (poolConfig[poolID].blockCount - 1)]);
+		tail++;
+	}
+	p->returnTail = tail;
+}
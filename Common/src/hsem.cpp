@@ -25,7 +25,7 @@ bool hsem::lock(HSEM_ID hsemID, Core_ID coreID)
 	uint32_t hsem = HSEM->RLR[hsemID];
 	
 	// success when lock bit is set, coreID matches, and processID = 0
-	return hsem = HSEM_RLR_LOCK | (coreID << HSEM_RLR_COREID_Pos);
+	return hsem == (HSEM_RLR_LOCK | (coreID << HSEM_RLR_COREID_Pos));
 }
 
 
@@ -48,3 +48,24 @@ bool hsem::isLocked(HSEM_ID hsemID)
 	// the semaphore is locked if the lock bit = 1 (RM0399 11.4.1)
 	return HSEM->R[hsemID] & HSEM_R_LOCK;
 }
+
+
+void hsem::enableInterrupt(HSEM_ID hsemID)
+{
+	// check inputs
+	if (hsemID > 31) { SYS_ERROR("invalid hsem_id: %d", hsemID); }
+	
+	// HSEM_COMMON points at the interrupt registers of the core this code is compiled for (RM0399 11.3.7), the
+	// interrupt fires on this core's HSEM IRQ line whenever the semaphore is released by either core
+	SET_BIT(HSEM_COMMON->IER, (1UL << hsemID));
+}
+
+
+void hsem::clearInterrupt(HSEM_ID hsemID)
+{
+	// check inputs
+	if (hsemID > 31) { SYS_ERROR("invalid hsem_id: %d", hsemID); }
+	
+	// write 1 to clear the interrupt status bit (RM0399 11.4.5)
+	HSEM_COMMON->ICR = (1UL << hsemID);
+}
\ No newline at end of file
@@ -0,0 +1,518 @@
+#include "../inc/ipcBench.h"
+#include "../inc/messageID.h"
+#include "../inc/messageSchema.h"
+#include "../inc/messageQueueLayout.h"
+#include "../inc/timebase.h"
+#include "../inc/stm32h745xx.h"
+#include "../inc/stm32h7xx.h"
+#include "../M4/Code/sys/system.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace ipcBench;
+using namespace messageQueue;
+
+
+// where the sending core is in the sweep, update moves it along without ever waiting on the other core
+enum SweepState {
+	SweepIdle = 0,
+	SweepStarting = 1,									// send BenchStart for the next case
+	SweepBursting = 2,									// top the queue up to the fill level and send one burst
+	SweepDraining = 3,									// wait for the receiver to empty the queue
+	SweepWaiting = 4									// BenchEnd sent, waiting for the BenchResult
+};
+
+// sending core
+static SweepState state;
+static SweepConfig sweep;
+static ReportCallback reportCallback;
+static uint32_t sizeIndex;
+static uint32_t burstIndex;
+static uint32_t fillIndex;
+static uint32_t nextCaseID;
+static CaseReport report;								// the case being sent
+static uint32_t attempted;
+static uint32_t waitStart;
+static uint8_t dataBuffer[MQ_MAX_MESSAGE_SIZE] __attribute__((aligned(4)));
+
+// copy benchmark, the ring is the lane's in SRAM4
+static uint8_t* copyRing;
+static uint32_t copyIndex;
+
+// receiving core
+static CaseResult measured;							// the case being received
+static uint32_t histogram[IPC_BENCH_HISTOGRAM_SIZE];
+static uint32_t firstSent;
+static uint32_t lastDispatched;
+static uint32_t sweepsReceived;
+
+static uint16_t caseSize(uint32_t index);
+static uint32_t fillTarget(uint32_t ringSize);
+static bool roomAfterFill(void);
+static bool sendControl(BenchCommand command);
+static void fill(void);
+static void burst(void);
+static void finishCase(bool timedOut);
+static void nextCase(void);
+static void receiveControl(const MessageView* msg);
+static void receiveData(const MessageView* msg);
+static void receiveResult(const MessageView* msg);
+static uint32_t percentile(uint32_t count, uint32_t percent);
+static uint32_t bucket(uint32_t ticks);
+static uint32_t bucketLimit(uint32_t index);
+static void byteLoopWrite(const uint8_t* data, uint32_t dataLen);
+static void byteLoopRead(uint8_t* dest, uint32_t dataLen);
+static void printCopyCycles(const char* direction, uint32_t size, const CopyCycles* cycles);
+static unsigned long bytesPerCycle(uint32_t size, uint32_t cycles);
+
+
+void ipcBench::defaultSweep(MessageQueueID msgQueueID, SweepConfig* config)
+{
+	*config = { msgQueueID, 1000,
+		7, { 0, 16, 64, 256, 512, 1024, MQ_MAX_MESSAGE_SIZE },
+		4, { 1, 4, 16, 32 },
+		3, { 0, 50, 90 } };
+}
+
+
+bool ipcBench::startSweep(const SweepConfig* config, ReportCallback report)
+{
+	// check inputs
+	if (state != SweepIdle) { return false; }
+	if ((config->sizeCount == 0) || (config->sizeCount > IPC_BENCH_MAX_STEPS) || (config->burstCount == 0) ||
+		(config->burstCount > IPC_BENCH_MAX_STEPS) || (config->fillCount == 0) || (config->fillCount > IPC_BENCH_MAX_STEPS)) {
+		SYS_WARN("invalid ipcBench sweep");
+		return false;
+	}
+	
+	sweep = *config;
+	reportCallback = report;
+	sizeIndex = 0;
+	burstIndex = 0;
+	fillIndex = 0;
+	state = SweepStarting;
+	return true;
+}
+
+
+bool ipcBench::running(void)
+{
+	return (state != SweepIdle);
+}
+
+
+uint32_t ipcBench::completedSweeps(void)
+{
+	return sweepsReceived;
+}
+
+
+void ipcBench::handleMessage(const MessageView* msg)
+{
+	if (msg->messageID == BenchControl) { receiveControl(msg); }
+	else if (msg->messageID == BenchData) { receiveData(msg); }
+	else if (msg->messageID == BenchResult) { receiveResult(msg); }
+}
+
+
+void ipcBench::update(void)
+{
+	switch (state) {
+		case(SweepStarting):
+			report = {};
+			report.benchCase.caseID = nextCaseID++;
+			report.benchCase.messages = sweep.messagesPerCase;
+			report.benchCase.size = caseSize(sizeIndex);
+			report.benchCase.burst = (sweep.bursts[burstIndex] > 0) ? sweep.bursts[burstIndex] : 1;
+			report.benchCase.fillPercent = (sweep.fillPercents[fillIndex] < 100) ? sweep.fillPercents[fillIndex] : 99;
+			report.benchCase.msgQueueID = sweep.msgQueueID;
+			attempted = 0;
+			
+			// sizes that clamp to the one before are the same case again, and a case that could never send a message
+			// at its fill level is reported without running it
+			if ((sizeIndex > 0) && (caseSize(sizeIndex - 1) == report.benchCase.size)) {
+				nextCaseID--;
+				nextCase();
+			} else if (!roomAfterFill()) {
+				report.skipped = true;
+				finishCase(false);
+			} else if (!sendControl(BenchStart)) {
+				finishCase(true);
+			} else {
+				state = SweepBursting;
+			}
+			break;
+		
+		case(SweepBursting):
+			// in one go, so the receiver has no chance to drain the fill before the burst
+			fill();
+			burst();
+			if (attempted < report.benchCase.messages) {
+				state = SweepDraining;
+			} else if (sendControl(BenchEnd)) {
+				waitStart = timebase::localMillis();
+				state = SweepWaiting;
+			} else {
+				finishCase(true);
+			}
+			break;
+		
+		case(SweepDraining):
+			// each burst starts from the same fill level, so let the receiver empty the queue first
+			if (!hasMessages(sweep.msgQueueID)) { state = SweepBursting; }
+			break;
+		
+		case(SweepWaiting):
+			if (timebase::localMillisSince(waitStart) >= IPC_BENCH_RESULT_MILLIS) { finishCase(true); }
+			break;
+		
+		default:
+			break;
+	}
+}
+
+
+void ipcBench::printHeader(void)
+{
+	printf("ipcbench,case,lane,size,burst,fill_pct,attempted,sent,dropped,received,msgs_per_s,kbytes_per_s,p50_ns,"
+		"p99_ns,max_ns,drop_ppm,timed_out,skipped\n");
+}
+
+
+void ipcBench::printReport(const CaseReport* report)
+{
+	// integer fields only, so the line prints the same with or without floating point printf support
+	const BenchCase* c = &report->benchCase;
+	const CaseResult* r = &report->result;
+	uint64_t elapsed = (r->elapsedTicks > 0) ? r->elapsedTicks : 1;
+	unsigned long caseID = c->caseID;
+	unsigned long lane = c->msgQueueID;
+	unsigned long size = c->size;
+	unsigned long burstLength = c->burst;
+	unsigned long fillPercent = c->fillPercent;
+	unsigned long messages = c->messages;
+	unsigned long sent = report->messagesSent;
+	unsigned long dropped = report->messagesDropped;
+	unsigned long received = r->messagesReceived;
+	unsigned long msgsPerSecond = ((uint64_t)r->messagesReceived * TB_TICKS_PER_SECOND) / elapsed;
+	unsigned long kbytesPerSecond = ((uint64_t)r->bytesReceived * (TB_TICKS_PER_SECOND / 1000)) / elapsed;
+	unsigned long p50 = ((uint64_t)r->p50Ticks * 1000000000ULL) / TB_TICKS_PER_SECOND;
+	unsigned long p99 = ((uint64_t)r->p99Ticks * 1000000000ULL) / TB_TICKS_PER_SECOND;
+	unsigned long max = ((uint64_t)r->maxTicks * 1000000000ULL) / TB_TICKS_PER_SECOND;
+	unsigned long dropPpm = (c->messages > 0) ? (((uint64_t)report->messagesDropped * 1000000) / c->messages) : 0;
+	printf("ipcbench,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%d,%d\n", caseID, lane, size,
+		burstLength, fillPercent, messages, sent, dropped, received, msgsPerSecond, kbytesPerSecond, p50, p99, max, dropPpm, report->timedOut,
+		report->skipped);
+}
+
+
+void ipcBench::copyBench(MessageQueueID msgQueueID, uint32_t size, CopyResult* result)
+{
+	// each copy is timed over IPC_BENCH_COPY_REPEATS runs, a single short copy is below the resolution of some clocks.
+	// The empty asm after every copy keeps the compiler from dropping or merging the copies nothing reads.
+	uint32_t ringSize;
+	copyRing = ringStorage(msgQueueID, &ringSize);
+	if (ringSize < IPC_BENCH_COPY_RING) { SYS_ERROR("ipcBench copy lane ring too small"); }
+	if (size > MQ_MAX_MESSAGE_SIZE) { size = MQ_MAX_MESSAGE_SIZE; }
+	for (uint32_t i = 0; i < size; ++i) { dataBuffer[i] = (uint8_t)i; }
+	result->size = size;
+	
+	copyIndex = 0;
+	uint32_t start = timebase::localCycles();
+	for (uint32_t i = 0; i < IPC_BENCH_COPY_REPEATS; ++i) {
+		byteLoopWrite(dataBuffer, size);
+		__asm__ volatile("" ::: "memory");
+	}
+	result->write.byteLoopCycles = timebase::localCycles() - start;
+	
+	start = timebase::localCycles();
+	for (uint32_t i = 0; i < IPC_BENCH_COPY_REPEATS; ++i) {
+		copyBytes(copyRing, dataBuffer, size);
+		__asm__ volatile("" ::: "memory");
+	}
+	result->write.copyBytesCycles = timebase::localCycles() - start;
+	
+	start = timebase::localCycles();
+	for (uint32_t i = 0; i < IPC_BENCH_COPY_REPEATS; ++i) {
+		memcpy(copyRing, dataBuffer, size);
+		__asm__ volatile("" ::: "memory");
+	}
+	result->write.memcpyCycles = timebase::localCycles() - start;
+	
+	// start the reads from SRAM4 rather than the M7's cache. With MQ_M7_DCACHE the M7's repeats still hit its cache, a
+	// real read invalidates the record first.
+	cleanShared(copyRing, IPC_BENCH_COPY_RING);
+	invalidateShared(copyRing, IPC_BENCH_COPY_RING);
+	
+	copyIndex = 0;
+	start = timebase::localCycles();
+	for (uint32_t i = 0; i < IPC_BENCH_COPY_REPEATS; ++i) {
+		byteLoopRead(dataBuffer, size);
+		__asm__ volatile("" ::: "memory");
+	}
+	result->read.byteLoopCycles = timebase::localCycles() - start;
+	
+	start = timebase::localCycles();
+	for (uint32_t i = 0; i < IPC_BENCH_COPY_REPEATS; ++i) {
+		copyBytes(dataBuffer, copyRing, size);
+		__asm__ volatile("" ::: "memory");
+	}
+	result->read.copyBytesCycles = timebase::localCycles() - start;
+	
+	start = timebase::localCycles();
+	for (uint32_t i = 0; i < IPC_BENCH_COPY_REPEATS; ++i) {
+		memcpy(dataBuffer, copyRing, size);
+		__asm__ volatile("" ::: "memory");
+	}
+	result->read.memcpyCycles = timebase::localCycles() - start;
+}
+
+
+void ipcBench::printCopyHeader(void)
+{
+	printf("copybench,direction,size,repeats,byte_loop_cycles,copybytes_cycles,memcpy_cycles,byte_loop_bpc,"
+		"copybytes_bpc,memcpy_bpc\n");
+}
+
+
+void ipcBench::printCopyResult(const CopyResult* result)
+{
+	printCopyCycles("write", result->size, &result->write);
+	printCopyCycles("read", result->size, &result->read);
+}
+
+
+uint16_t caseSize(uint32_t index)
+{
+	uint16_t limit = maxPayload(sweep.msgQueueID);
+	return (sweep.sizes[index] < limit) ? sweep.sizes[index] : limit;
+}
+
+
+bool sendControl(BenchCommand command)
+{
+	// sent on the measured lane so it stays in order with the data, waits if the last case left the queue full
+	report.benchCase.command = command;
+	return send<BenchControl>(sweep.msgQueueID, report.benchCase, SendBlockMillis, IPC_BENCH_RESULT_MILLIS) == SendOK;
+}
+
+
+uint32_t fillTarget(uint32_t ringSize)
+{
+	// ring bytes in use, headers included, that each burst of the case starts from
+	return (ringSize * report.benchCase.fillPercent) / 100;
+}
+
+
+bool roomAfterFill(void)
+{
+	// a full fill still has to leave room for one whole record of the case's size
+	QueueMetrics metrics;
+	getMetrics(sweep.msgQueueID, &metrics);
+	return (metrics.size - fillTarget(metrics.size)) >= (uint32_t)(report.benchCase.size + MQ_MAX_HEADER_SIZE);
+}
+
+
+void fill(void)
+{
+	// NoOp messages bring the ring up to the fill level, every core ignores them. Each is at most the case's size and
+	// never larger than the room left below the level, so the fill stops within a header's worth of it instead of
+	// overshooting by up to a whole message. The receiver is draining the queue at the same time, so give up after as
+	// many messages as the ring could ever hold.
+	QueueMetrics metrics;
+	getMetrics(sweep.msgQueueID, &metrics);
+	uint32_t target = fillTarget(metrics.size);
+	uint32_t attempts = metrics.size / 4;
+	while (((metrics.bytesInQueue + MQ_MAX_HEADER_SIZE) <= target) && (attempts-- > 0)) {
+		uint32_t len = target - metrics.bytesInQueue - MQ_MAX_HEADER_SIZE;
+		if (len > report.benchCase.size) { len = report.benchCase.size; }
+		if (sendMessage(sweep.msgQueueID, NoOp, (uint16_t)(len & ~3UL), dataBuffer) != SendOK) { break; }
+		getMetrics(sweep.msgQueueID, &metrics);
+	}
+}
+
+
+void burst(void)
+{
+	// back to back with no waiting, a full queue drops the message
+	for (uint32_t i = 0; (i < report.benchCase.burst) && (attempted < report.benchCase.messages); ++i) {
+		if (report.benchCase.size >= sizeof(attempted)) { *(uint32_t*)dataBuffer = attempted; }
+		if (sendMessage(sweep.msgQueueID, BenchData, report.benchCase.size, dataBuffer) == SendOK) { report.messagesSent++; }
+		else { report.messagesDropped++; }
+		attempted++;
+	}
+}
+
+
+void finishCase(bool timedOut)
+{
+	report.timedOut = timedOut;
+	if (timedOut) { report.result = {}; }
+	if (reportCallback != 0) { reportCallback(&report); }
+	nextCase();
+}
+
+
+void nextCase(void)
+{
+	// fill level changes fastest, then burst length, then size
+	state = SweepStarting;
+	if (++fillIndex < sweep.fillCount) { return; }
+	fillIndex = 0;
+	if (++burstIndex < sweep.burstCount) { return; }
+	burstIndex = 0;
+	if (++sizeIndex < sweep.sizeCount) { return; }
+	
+	// tell the receiver there is nothing more to come
+	sendControl(BenchSweepDone);
+	state = SweepIdle;
+}
+
+
+void receiveControl(const MessageView* msg)
+{
+	const BenchCase* c = payload<BenchControl>(msg);
+	if (c == 0) {
+		SYS_WARN("malformed BenchControl");
+		return;
+	}
+	
+	switch (c->command) {
+		case(BenchStart):
+			measured = {};
+			measured.caseID = c->caseID;
+			for (uint32_t i = 0; i < IPC_BENCH_HISTOGRAM_SIZE; ++i) { histogram[i] = 0; }
+			break;
+		
+		case(BenchEnd):
+			// report on the lane of the same kind going back, a dropped result times out on the sender
+			if (measured.caseID != c->caseID) {
+				// the BenchStart never arrived, nothing was measured
+				measured = {};
+				measured.caseID = c->caseID;
+			}
+			measured.elapsedTicks = (measured.messagesReceived > 0) ? (lastDispatched - firstSent) : 0;
+			measured.p50Ticks = percentile(measured.messagesReceived, 50);
+			measured.p99Ticks = percentile(measured.messagesReceived, 99);
+			send<BenchResult>((MessageQueueID)(c->msgQueueID ^ 1), measured, SendBlockMillis, IPC_BENCH_RESULT_MILLIS);
+			break;
+		
+		case(BenchSweepDone):
+			sweepsReceived++;
+			break;
+		
+		default:
+			SYS_WARN("unknown BenchControl command");
+			break;
+	}
+}
+
+
+void receiveData(const MessageView* msg)
+{
+	// time from the send timestamp to this dispatch, lanes without timestamps are only counted
+	uint32_t now = timebase::now();
+	if (msg->hasSendTime) {
+		if (measured.messagesReceived == 0) { firstSent = msg->sendTime; }
+		uint32_t ticks = now - msg->sendTime;
+		histogram[bucket(ticks)]++;
+		if (ticks > measured.maxTicks) { measured.maxTicks = ticks; }
+	}
+	lastDispatched = now;
+	measured.messagesReceived++;
+	measured.bytesReceived += msg->dataLen;
+}
+
+
+void receiveResult(const MessageView* msg)
+{
+	const CaseResult* result = payload<BenchResult>(msg);
+	if (result == 0) {
+		SYS_WARN("malformed BenchResult");
+		return;
+	}
+	
+	// results of cases that already timed out no longer match
+	if ((state != SweepWaiting) || (result->caseID != report.benchCase.caseID)) { return; }
+	report.result = *result;
+	finishCase(false);
+}
+
+
+uint32_t percentile(uint32_t count, uint32_t percent)
+{
+	// upper bound of the bucket holding the message at that rank, never above the exact maximum
+	uint32_t rank = ((count * percent) + 99) / 100;
+	uint32_t seen = 0;
+	for (uint32_t i = 0; (i < IPC_BENCH_HISTOGRAM_SIZE) && (rank > 0); ++i) {
+		seen += histogram[i];
+		if (seen >= rank) {
+			uint32_t limit = bucketLimit(i);
+			return (limit < measured.maxTicks) ? limit : measured.maxTicks;
+		}
+	}
+	return 0;
+}
+
+
+uint32_t bucket(uint32_t ticks)
+{
+	// exact below 8 ticks, above that 8 buckets per power of two from the 3 bits under the leading one
+	if (ticks < 8) { return ticks; }
+	uint32_t exponent = 31 - __CLZ(ticks);
+	return ((exponent - 2) * 8) + ((ticks >> (exponent - 3)) & 7);
+}
+
+
+uint32_t bucketLimit(uint32_t index)
+{
+	// the largest tick count that falls in the bucket
+	if (index < 8) { return index; }
+	uint32_t shift = (index / 8) - 1;
+	return ((8 + (index % 8)) << shift) + ((1UL << shift) - 1);
+}
+
+
+void byteLoopWrite(const uint8_t* data, uint32_t dataLen)
+{
+	// the ring's original writeBytes, one byte and one index wrap at a time
+	for (uint32_t i = 0; i < dataLen; ++i) {
+		copyRing[copyIndex] = data[i];
+		copyIndex = ((copyIndex + 1) % IPC_BENCH_COPY_RING);
+	}
+}
+
+
+void byteLoopRead(uint8_t* dest, uint32_t dataLen)
+{
+	// the ring's original readBytes
+	for (uint32_t i = 0; i < dataLen; ++i) {
+		dest[i] = copyRing[copyIndex];
+		copyIndex = ((copyIndex + 1) % IPC_BENCH_COPY_RING);
+	}
+}
+
+
+void printCopyCycles(const char* direction, uint32_t size, const CopyCycles* cycles)
+{
+	// bytes per cycle with three decimals, printed from integers like printReport
+	unsigned long sizeBytes = size;
+	unsigned long repeats = IPC_BENCH_COPY_REPEATS;
+	unsigned long byteLoopCycles = cycles->byteLoopCycles;
+	unsigned long copyBytesCycles = cycles->copyBytesCycles;
+	unsigned long memcpyCycles = cycles->memcpyCycles;
+	unsigned long byteLoopRate = bytesPerCycle(size, cycles->byteLoopCycles);
+	unsigned long copyBytesRate = bytesPerCycle(size, cycles->copyBytesCycles);
+	unsigned long memcpyRate = bytesPerCycle(size, cycles->memcpyCycles);
+	printf("copybench,%s,%lu,%lu,%lu,%lu,%lu,%lu.%03lu,%lu.%03lu,%lu.%03lu\n", direction, sizeBytes, repeats,
+		byteLoopCycles, copyBytesCycles, memcpyCycles, byteLoopRate / 1000, byteLoopRate % 1000, copyBytesRate / 1000,
+		copyBytesRate % 1000, memcpyRate / 1000, memcpyRate % 1000);
+}
+
+
+unsigned long bytesPerCycle(uint32_t size, uint32_t cycles)
+{
+	// in thousandths of a byte
+	if (cycles == 0) { cycles = 1; }
+	return (unsigned long)(((uint64_t)size * IPC_BENCH_COPY_REPEATS * 1000) / cycles);
+}
@@ -0,0 +1,92 @@
+#include "../inc/mailbox.h"
+#include "../inc/messageQueue.h"
+#include "../inc/messageQueueLayout.h"
+#include "../inc/subscription.h"
+#include "../inc/stm32h745xx.h"
+#include "../inc/stm32h7xx.h"
+#include "../M4/Code/sys/system.h"
+#include <string.h>
+
+using namespace mailbox;
+using namespace messageQueue;
+
+
+// how many times read tries again when a write lands in the middle of its copy before giving up until the next call
+#define MB_READ_RETRIES 4
+
+// the mailboxes live in the SRAM4_MQ region after the message queues, see messageQueueLayout.h
+static MailboxSlot* slot(MailboxID mailboxID)
+{
+	return &((MessageQueueLayout*)regionBase())->mailboxes[mailboxID];
+}
+
+
+void mailbox::init(MailboxID mailboxID)
+{
+	// an even sequence of 0 means the mailbox has never been written
+	memset(slot(mailboxID), 0, sizeof(MailboxSlot));
+}
+
+
+bool mailbox::write(MailboxID mailboxID, MessageID messageID, uint16_t dataLen, const uint8_t* data)
+{
+	MailboxSlot* m = slot(mailboxID);
+	
+	if (dataLen > MB_MAX_VALUE_SIZE) {
+		SYS_ERROR("mailbox value too large");
+		return false;
+	}
+	
+	// a value the reading core would only drop is not worth the write, even IDs are read by the M7
+	hsem::Core_ID reader = ((mailboxID & 1) == 0) ? hsem::m7_coreID : hsem::m4_coreID;
+	if (!subscription::subscribed(reader, messageID)) { return false; }
+	
+	// make the sequence odd so readers know the value is being changed
+	uint32_t sequence = m->sequence;
+	m->sequence = sequence + 1;
+	cleanShared(&m->sequence, sizeof(m->sequence));
+	__DMB();
+	
+	m->value.messageID = messageID;
+	m->value.dataLen = dataLen;
+	copyBytes(m->value.data, data, dataLen);
+	cleanShared(&m->value, sizeof(m->value));
+	
+	// make sure the whole value lands before the sequence goes even again
+	__DMB();
+	m->sequence = sequence + 2;
+	cleanShared(&m->sequence, sizeof(m->sequence));
+	return true;
+}
+
+
+bool mailbox::read(MailboxID mailboxID, uint32_t* lastSequence, MailboxValue* value)
+{
+	MailboxSlot* m = slot(mailboxID);
+	
+	for (uint32_t i = 0; i < MB_READ_RETRIES; ++i) {
+		invalidateShared(m, sizeof(MailboxSlot));
+		uint32_t sequence = m->sequence;
+		if (sequence == *lastSequence) { return false; }
+		if (sequence & 1) { continue; }
+		
+		// make sure the sequence is read before the value it covers
+		__DMB();
+		
+		// a torn copy is thrown away below, but clamp the length so it can never overrun value
+		value->messageID = m->value.messageID;
+		value->dataLen = m->value.dataLen;
+		if (value->dataLen > MB_MAX_VALUE_SIZE) { value->dataLen = MB_MAX_VALUE_SIZE; }
+		copyBytes(value->data, m->value.data, value->dataLen);
+		
+		// finish copying the value before checking that the writer did not touch it in the meantime
+		__DMB();
+		invalidateShared(&m->sequence, sizeof(m->sequence));
+		if (m->sequence == sequence) {
+			*lastSequence = sequence;
+			return true;
+		}
+	}
+	
+	return false;
+}
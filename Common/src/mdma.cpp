@@ -0,0 +1,128 @@
+#include "../inc/mdma.h"
+#include "../inc/stm32h745xx.h"
+#include "../inc/stm32h7xx.h"
+#include "../M4/Code/sys/system.h"
+
+using namespace mdma;
+
+
+#define MDMA_CHANNEL_COUNT 16
+#define MDMA_MAX_BLOCK 65536							// BNDT is 17 bits but the block length limit is 64kB (RM0399 15.3.4)
+
+// CTCR field values for a software triggered, incrementing memory to memory block copy (RM0399 15.5.6)
+#define MDMA_INCREMENT 0b10
+#define MDMA_SIZE_BYTE 0b00
+#define MDMA_SIZE_WORD 0b10
+#define MDMA_TLEN_MAX 127								// largest buffer transfer, 128 bytes per request burst
+#define MDMA_TRGM_BLOCK 0b01
+
+// completion callbacks of the copies this core started, each core only has its own in its RAM
+static Callback callbacks[MDMA_CHANNEL_COUNT];
+static void* contexts[MDMA_CHANNEL_COUNT];
+static volatile uint32_t activeChannels;
+
+static MDMA_Channel_TypeDef* channelRegs(MDMA_Channel channel)
+{
+	// the channel register blocks are 0x40 bytes apart
+	return (MDMA_Channel_TypeDef*)(MDMA_Channel0_BASE + (0x40UL * channel));
+}
+
+static uint32_t busAddress(const void* addr);
+static bool tcmAddress(uint32_t addr);
+
+
+void mdma::init(void)
+{
+	// turn on the MDMA clock, the block is shared so it is never reset here in case the other core is using it
+	SET_BIT(RCC->AHB3ENR, RCC_AHB3ENR_MDMAEN);
+	(void)READ_BIT(RCC->AHB3ENR, RCC_AHB3ENR_MDMAEN);	// delay after enabling the clock
+}
+
+
+bool mdma::busy(MDMA_Channel channel)
+{
+	return (activeChannels & (1UL << channel)) != 0;
+}
+
+
+bool mdma::copy(MDMA_Channel channel, void* dest, const void* src, uint32_t len, Callback done, void* context)
+{
+	// check inputs
+	if (channel >= MDMA_CHANNEL_COUNT) { SYS_ERROR("invalid mdma channel: %d", channel); }
+	if ((len == 0) || (len >= MDMA_MAX_BLOCK)) { SYS_ERROR("invalid mdma copy length: %lu", len); }
+	if (busy(channel)) { return false; }
+	
+	MDMA_Channel_TypeDef* c = channelRegs(channel);
+	uint32_t srcAddr = busAddress(src);
+	uint32_t destAddr = busAddress(dest);
+	
+	// move whole words when both ends are word aligned and the length allows it, otherwise bytes
+	uint32_t size = (((srcAddr | destAddr | len) & 3) == 0) ? MDMA_SIZE_WORD : MDMA_SIZE_BYTE;
+	
+	callbacks[channel] = done;
+	contexts[channel] = context;
+	
+	// the completion interrupt clears its own channel's bit, keep it from landing in the middle of setting this one
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	activeChannels = activeChannels | (1UL << channel);
+	__set_PRIMASK(primask);
+	
+	// one block of len bytes, started by a single software request
+	c->CCR = 0;
+	c->CIFCR = MDMA_CIFCR_CTEIF | MDMA_CIFCR_CCTCIF | MDMA_CIFCR_CBRTIF | MDMA_CIFCR_CBTIF | MDMA_CIFCR_CLTCIF;
+	c->CTCR = (MDMA_INCREMENT << MDMA_CTCR_SINC_Pos) | (MDMA_INCREMENT << MDMA_CTCR_DINC_Pos) |
+		(size << MDMA_CTCR_SSIZE_Pos) | (size << MDMA_CTCR_DSIZE_Pos) | (size << MDMA_CTCR_SINCOS_Pos) |
+		(size << MDMA_CTCR_DINCOS_Pos) | (MDMA_TLEN_MAX << MDMA_CTCR_TLEN_Pos) | (MDMA_TRGM_BLOCK << MDMA_CTCR_TRGM_Pos) |
+		(1UL << MDMA_CTCR_SWRM_Pos);
+	c->CBNDTR = len;
+	c->CSAR = srcAddr;
+	c->CDAR = destAddr;
+	c->CBRUR = 0;
+	c->CLAR = 0;										// no linked list, the channel stops after the block
+	c->CTBR = (tcmAddress(srcAddr) ? MDMA_CTBR_SBUS : 0) | (tcmAddress(destAddr) ? MDMA_CTBR_DBUS : 0);
+	
+	// make sure everything the CPU wrote to the source is out of the write buffer before the MDMA reads it
+	__DSB();
+	c->CCR = MDMA_CCR_CTCIE | MDMA_CCR_TEIE | MDMA_CCR_EN;
+	c->CCR |= MDMA_CCR_SWRQ;
+	return true;
+}
+
+
+uint32_t busAddress(const void* addr)
+{
+	// the M4 runs out of the D2 SRAM alias at 0x10000000, the MDMA only sees it at its system address 0x30000000
+	uint32_t a = (uint32_t)(uintptr_t)addr;
+	return ((a >= 0x10000000UL) && (a < 0x10048000UL)) ? (a + 0x20000000UL) : a;
+}
+
+
+bool tcmAddress(uint32_t addr)
+{
+	// the M7's ITCM and DTCM are only reachable through the AHBS port (RM0399 15.3.2)
+	return (addr < 0x00010000UL) || ((addr >= 0x20000000UL) && (addr < 0x20020000UL));
+}
+
+
+extern "C" void MDMA_IRQHandler(void)
+{
+	// both cores get every MDMA interrupt, only look at the channels this core started
+	uint32_t pending = MDMA->GISR0 & activeChannels;
+	
+	while (pending) {
+		uint32_t channel = 31 - __CLZ(pending);
+		pending &= ~(1UL << channel);
+		MDMA_Channel_TypeDef* c = channelRegs((MDMA_Channel)channel);
+		
+		uint32_t status = c->CISR;
+		if (status & MDMA_CISR_TEIF) { SYS_ERROR("mdma transfer error on channel %lu: 0x%lx", channel, c->CESR); }
+		if (status & MDMA_CISR_CTCIF) {
+			// free the channel before calling back, so the callback can start the next copy straight away
+			c->CIFCR = MDMA_CIFCR_CCTCIF | MDMA_CIFCR_CBTIF | MDMA_CIFCR_CBRTIF | MDMA_CIFCR_CLTCIF;
+			c->CCR = 0;
+			activeChannels = activeChannels & ~(1UL << channel);
+			if (callbacks[channel] != 0) { callbacks[channel](contexts[channel]); }
+		}
+	}
+}
@@ -1,145 +1,906 @@
 #include "../inc/messageQueue.h"
+#include "../inc/messageQueueLayout.h"
+#include "../inc/mdma.h"
+#include "../inc/timebase.h"
+#include "../inc/subscription.h"
+#include "../inc/stm32h745xx.h"
+#include "../inc/stm32h7xx.h"
 #include "../M4/Code/sys/system.h"
 #include <string.h>
 
 using namespace messageQueue;
 using namespace hsem;
 
-struct MessageQueue {
-	uint32_t pendingMessages;				// the number of messages in the queue waiting to be processed
-	uint32_t maxPendingMessages;			// the largest number of pending messages ever in the queue at once
-	uint32_t bytesInQueue;					// number of bytes currently in the queue
-	uint32_t maxBytesInQueue;				// the largest number of bytes ever contained in the queue
-	uint32_t head;							// buffer index where the next byte should be written
-	uint32_t tail;							// buffer index where the next byte should be read
-	HSEM_ID hsemID;							// hardware semaphore controlling access to this queue
-	uint8_t buffer[MQ_MESSAGE_QUEUE_SIZE];	// the queue data buffer
+
+/* Record format v2: every record starts with a 2 byte MessageID and a 2 byte dataLen packed into one little-endian word,
+ * followed by the 4 byte send time on queues initialized with timestamps and then the payload. Each record is padded to
+ * a multiple of MQ_RECORD_ALIGN bytes, so every header, timestamp and payload starts word aligned and can be accessed
+ * with whole word loads and stores. */
+#define MQ_RECORD_FORMAT 2
+#define MQ_HEADER_SIZE 4
+#define MQ_TIMESTAMP_SIZE 4
+#define MQ_RECORD_ALIGN 4
+
+static_assert((MQ_HEADER_SIZE + MQ_TIMESTAMP_SIZE) <= MQ_MAX_HEADER_SIZE, "record header larger than messageQueueLayout.h allows for");
+
+// MessageID value written in front of the unused end of the buffer when a record wraps back to the start
+#define MQ_WRAP_MARKER 0xFFFF
+
+// word type used by the copy engine, allowed to alias the byte buffers it copies between
+typedef uint32_t __attribute__((may_alias)) aliasWord;
+
+// where each queue lives in the layout, its size and its hardware semaphores, indexed by MessageQueueID
+struct QueueConfig {
+	uint32_t offset;
+	uint32_t size;
+	uint32_t maxMessageSize;
+	HSEM_ID hsemID;
+	HSEM_ID doorbellID;
+};
+
+#define MQ_QUEUE_CONFIG(member, hsemID, doorbellID) { offsetof(MessageQueueLayout, member), \
+	decltype(MessageQueueLayout::member)::capacity, decltype(MessageQueueLayout::member)::maxMessageSize, hsemID, doorbellID }
+
+static constexpr QueueConfig queueConfig[MQ_QUEUE_COUNT] = {
+	MQ_QUEUE_CONFIG(m4toM7, hsemID_M4toM7, hsemID_DoorbellM4toM7),
+	MQ_QUEUE_CONFIG(m7toM4, hsemID_M7toM4, hsemID_DoorbellM7toM4),
+	MQ_QUEUE_CONFIG(m4toM7_Control, hsemID_M4toM7_Control, hsemID_DoorbellM4toM7),
+	MQ_QUEUE_CONFIG(m7toM4_Control, hsemID_M7toM4_Control, hsemID_DoorbellM7toM4),
+	MQ_QUEUE_CONFIG(m4toM7_Bulk, hsemID_M4toM7_Bulk, hsemID_DoorbellM4toM7),
+	MQ_QUEUE_CONFIG(m7toM4_Bulk, hsemID_M7toM4_Bulk, hsemID_DoorbellM7toM4)
+};
+
+// the buffer is found right after the control block, so both have to stay word aligned and back to back
+static_assert(offsetof(decltype(MessageQueueLayout::m4toM7), buffer) == sizeof(MessageQueueControl), "queue buffer must follow its control block");
+
+static constexpr uint32_t layoutKey(uint32_t msgQueueID)
+{
+	// fingerprint of everything both cores have to agree on for one queue
+	return ((((queueConfig[msgQueueID].offset * 31) + queueConfig[msgQueueID].size) * 31 +
+		queueConfig[msgQueueID].maxMessageSize) * 31) + sizeof(MessageQueueControl) + (sizeof(MessageQueueLayout) << 16) +
+		(MQ_RECORD_FORMAT << 28);
+}
+
+
+// Declare that the message queues start at the lowest address in the 32kB _sram4_mq memory, this way both M4 and M7
+// will accesss them at the same address. The _sram4_mq and _sram4_mq_size values are defined in the linker file for
+// both processors, the address of _sram4_mq_size is the length of the region.
+extern void* _sram4_mq_size;
+
+static MessageQueueControl* queue(MessageQueueID msgQueueID)
+{
+	// do sketchy pointer math to get the memory location of our quasi-legal message queues
+	return (MessageQueueControl*)(regionBase() + queueConfig[msgQueueID].offset);
+}
+
+static Core_ID consumer(MessageQueueID msgQueueID)
+{
+	// even IDs are sent by the M4 and read by the M7
+	return ((msgQueueID & 1) == 0) ? m7_coreID : m4_coreID;
+}
+
+static uint8_t* ringBuffer(MessageQueueControl* q)
+{
+	// the ring buffer starts right after the control block
+	return (uint8_t*)(q + 1);
+}
+
+static aliasWord* ringWord(MessageQueueControl* q, uint32_t index)
+{
+	// the word at a free-running index, records are word aligned so headers never need a byte copy
+	return (aliasWord*)&ringBuffer(q)[index & q->mask];
+}
+
+static uint32_t recordSize(MessageQueueControl* q, uint32_t dataLen)
+{
+	// bytes taken up in the ring by a record, padding included
+	return (q->headerSize + dataLen + (MQ_RECORD_ALIGN - 1)) & ~(uint32_t)(MQ_RECORD_ALIGN - 1);
+}
+
+// an MDMA copy into or out of a queue, only the core that started it looks at it. A core either produces or consumes
+// each queue, so one per queue covers both directions.
+struct AsyncCopy {
+	MessageQueueID msgQueueID;
+	volatile bool pending;								// the queue is reserved or peeked until the copy completes
+	AsyncCallback done;
+	void* context;
+	uint8_t* dest;										// what the M7 invalidates once a read has landed
+	uint32_t len;
 };
 
+static AsyncCopy asyncCopies[MQ_QUEUE_COUNT];
+static uint32_t dmaThreshold = MQ_DMA_THRESHOLD;
+static const mdma::MDMA_Channel sendChannel = (localCoreID == m4_coreID) ? mdma::mdmaChannel_M4Send : mdma::mdmaChannel_M7Send;
+static const mdma::MDMA_Channel receiveChannel = (localCoreID == m4_coreID) ? mdma::mdmaChannel_M4Receive : mdma::mdmaChannel_M7Receive;
 
-// Declare that we have a MessageQueue structure starting at the lowest address in the 32kB _sram4_IPC memory
-// this way both M4 and M7 will accesss it at the same address. The _ssram4_IPC value is defined
-// in the linker file for both processors. 
-extern void* _sram4_mq;
-static MessageQueue* mq = (MessageQueue*)&_sram4_mq;
+// the cache lines written by the producer, the consumer and at init, see messageQueueLayout.h
+#define MQ_PRODUCER_BYTES (offsetof(MessageQueueControl, tail) - offsetof(MessageQueueControl, head))
+#define MQ_CONSUMER_BYTES (offsetof(MessageQueueControl, layoutKey) - offsetof(MessageQueueControl, tail))
+#define MQ_CONFIG_BYTES (sizeof(MessageQueueControl) - offsetof(MessageQueueControl, layoutKey))
 
 
-static void writeBytes(MessageQueue* q, uint8_t* data, uint32_t dataLen);
-static void readBytes(MessageQueue* q, uint8_t* dest, uint32_t dataLen);
+static void acquire(MessageQueueControl* q, LockMetrics* metrics);
+static void release(MessageQueueControl* q, LockMetrics* metrics);
+static uint32_t recordStart(MessageQueueControl* q, uint32_t index, uint32_t msgSize);
+static uint8_t* writeHeader(MessageQueueControl* q, uint32_t index, uint32_t start, MessageID messageID, uint16_t dataLen);
+static void publish(MessageQueueControl* q, uint32_t messageCount);
+static uint32_t batchEnd(MessageQueueControl* q, uint32_t index, const MessageDescriptor* messages, uint32_t count);
+static bool claim(MessageQueueControl* q, const MessageDescriptor* messages, uint32_t count, uint32_t* index);
+static void leaveProducer(MessageQueueControl* q);
+static void publishShared(MessageQueueControl* q);
+static void ringDoorbell(MessageQueueControl* q);
+static uint32_t atomicAdd(volatile uint32_t* value, uint32_t delta);
+static uint32_t skipWrap(MessageQueueControl* q, uint32_t index);
+static bool deadlinePassed(SendMode mode, uint32_t start, uint32_t timeout);
+static void cleanRing(MessageQueueControl* q, uint32_t from, uint32_t to);
+static void invalidateRing(MessageQueueControl* q, uint32_t from, uint32_t to);
+static void sendDone(void* context);
+static void readDone(void* context);
 
 
-void messageQueue::init(MessageQueueID msgQueueID)
+void messageQueue::init(MessageQueueID msgQueueID, LockMode lockMode, bool timestamps)
 {
-	// do sketchy pointer math to get the memory location of our quasi-legal message queues,
-	// msgQueueID is 0 for M4toM7, 1 for M7toM4
-	MessageQueue* q = &mq[msgQueueID]; 
+	MessageQueueControl* q = queue(msgQueueID);
+	
+	// the layout is checked against MQ_REGION_SIZE at compile time, also check it against the region the linker
+	// actually reserved in case the two have drifted apart
+	if (sizeof(MessageQueueLayout) > (uintptr_t)&_sram4_mq_size) { SYS_ERROR("message queues do not fit in the SRAM4_MQ region"); }
 	
-	// zero out all data, record which HSEM_ID should be locked to access this queue
-	memset(q, 0, sizeof(MessageQueue));
-	q->hsemID = (msgQueueID == M4toM7) ? hsemID_M4toM7 : hsemID_M7toM4;
+	// zero out the control block, record the buffer size and which HSEM_IDs belong to this queue
+	memset(q, 0, sizeof(MessageQueueControl));
+	q->layoutKey = layoutKey(msgQueueID);
+	q->size = queueConfig[msgQueueID].size;
+	q->mask = queueConfig[msgQueueID].size - 1;
+	q->maxMessageSize = queueConfig[msgQueueID].maxMessageSize;
+	q->headerSize = timestamps ? (MQ_HEADER_SIZE + MQ_TIMESTAMP_SIZE) : MQ_HEADER_SIZE;
+	q->hsemID = queueConfig[msgQueueID].hsemID;
+	q->doorbellID = queueConfig[msgQueueID].doorbellID;
+	q->lockMode = lockMode;
+	cleanShared(q, sizeof(MessageQueueControl));
 }
 
 
 bool messageQueue::hasMessages(MessageQueueID msgQueueID)
 {
-	// do sketchy pointer math to get the memory location of our quasi-legal message queues,
-	// msgQueueID is 0 for M4toM7, 1 for M7toM4
-	MessageQueue* q = &mq[msgQueueID]; 
+	MessageQueueControl* q = queue(msgQueueID);
 	
-	// this is a read-only operation so we do not need to acquire a lock
-	return (q->pendingMessages > 0);
+	// this is a read-only operation so we do not need to acquire a lock, the producer only moves head
+	// after the message is completely written
+	invalidateShared(&q->head, sizeof(q->head));
+	return (q->head != q->tail);
 }
 
 
-void messageQueue::sendMessage(MessageQueueID msgQueueID, MessageID command, uint16_t dataLen, uint8_t* data)
+bool messageQueue::layoutMatches(MessageQueueID msgQueueID)
 {
-	// do sketchy pointer math to get the memory location of our quasi-legal message queues,
-	// msgQueueID is 0 for M4toM7, 1 for M7toM4
-	MessageQueue* q = &mq[msgQueueID]; 
-	Core_ID coreID = (msgQueueID) ? m4_coreID : m7_coreID;
+	MessageQueueControl* q = queue(msgQueueID);
 	
-	// sanity checks
-	uint32_t msgSize = (sizeof(command) + sizeof(dataLen) + dataLen);
-	if (msgSize > MQ_MAX_MESSAGE_SIZE) { SYS_ERROR("message size too large"); }
-	if ((MQ_MESSAGE_QUEUE_SIZE - q->bytesInQueue) < msgSize) { 
-		// drop the message if there is no room for it, e.g. when one core is halted for debugging and not 
+	// the producer core wrote its own build's layout key when it initialized the queue
+	invalidateShared(&q->layoutKey, MQ_CONFIG_BYTES);
+	return (q->layoutKey == layoutKey(msgQueueID));
+}
+
+
+void messageQueue::enableDoorbell(MessageQueueID msgQueueID)
+{
+	MessageQueueControl* q = queue(msgQueueID);
+	
+	// the consumer core asks the HSEM block to interrupt it whenever the doorbell semaphore is released, the
+	// caller still has to enable its core's HSEM IRQ in the NVIC and clear the interrupt in the handler
+	enableInterrupt(q->doorbellID);
+}
+
+
+bool messageQueue::armDoorbell(MessageQueueID msgQueueID)
+{
+	MessageQueueControl* q = queue(msgQueueID);
+	
+	// ask for a doorbell on the next published message, unless one was already asked for and not yet rung
+	invalidateShared(&q->doorbellRung, sizeof(q->doorbellRung));
+	if (q->doorbellArmed == q->doorbellRung) {
+		q->doorbellArmed = q->doorbellArmed + 1;
+		cleanShared(&q->doorbellArmed, sizeof(q->doorbellArmed));
+	}
+	
+	// the producer publishes head before checking doorbellArmed, so checking head after arming guarantees that
+	// either we see the message here or the producer sees the request and rings
+	__DMB();
+	invalidateShared(&q->head, sizeof(q->head));
+	return (q->head == q->tail);
+}
+
+
+SendStatus messageQueue::sendMessage(MessageQueueID msgQueueID, MessageID messageID, uint16_t dataLen, const uint8_t* data,
+	SendMode mode, uint32_t timeout)
+{
+	// copy the payload into a reservation and publish it
+	SendStatus status;
+	uint8_t* payload = reserveMessage(msgQueueID, messageID, dataLen, mode, timeout, &status);
+	if (payload != 0) {
+		copyBytes(payload, data, dataLen);
+		commitMessage(msgQueueID);
+	}
+	return status;
+}
+
+
+uint8_t* messageQueue::reserveMessage(MessageQueueID msgQueueID, MessageID messageID, uint16_t dataLen, SendMode mode,
+	uint32_t timeout, SendStatus* status)
+{
+	MessageQueueControl* q = queue(msgQueueID);
+	
+	if ((q->headerSize + dataLen) > q->maxMessageSize) {
+		*status = SendTooLarge;
+		return 0;
+	}
+	if (!subscription::subscribed(consumer(msgQueueID), messageID)) {
+		*status = SendUnsubscribed;
+		return 0;
+	}
+	
+	// reserve room for the message directly in the queue
+	uint8_t* payload = reserveMessage(msgQueueID, messageID, dataLen);
+	if ((payload == 0) && (mode != SendDrop)) {
+		// keep trying while the consumer core frees up space, the deadline only starts counting once the queue is full
+		uint32_t start = (mode == SendBlockMillis) ? timebase::localMillis() : timebase::localCycles();
+		while ((payload == 0) && !deadlinePassed(mode, start, timeout)) {
+			payload = reserveMessage(msgQueueID, messageID, dataLen);
+		}
+	}
+	
+	if (payload == 0) {
+		// drop the message if there is still no room for it, e.g. when one core is halted for debugging and not 
 		// processing incoming messages 
-		SYS_ERROR("message queue overflow, message dropped"); 
+		atomicAdd(&q->messagesDropped, 1);
+		*status = (mode == SendDrop) ? SendDropped : SendTimedOut;
+		return 0;
+	}
+	
+	*status = SendOK;
+	return payload;
+}
+
+
+SendStatus messageQueue::sendMessageAsync(MessageQueueID msgQueueID, MessageID messageID, uint16_t dataLen,
+	const uint8_t* data, AsyncCallback done, void* context)
+{
+	MessageQueueControl* q = queue(msgQueueID);
+	AsyncCopy* a = &asyncCopies[msgQueueID];
+	
+	if ((q->headerSize + dataLen) > q->maxMessageSize) { return SendTooLarge; }
+	if (!subscription::subscribed(consumer(msgQueueID), messageID)) { return SendUnsubscribed; }
+	
+	// one copy per queue can be in flight, a MultiProducer queue takes other sends meanwhile but not another async one
+	uint8_t* payload = a->pending ? 0 : reserveMessage(msgQueueID, messageID, dataLen);
+	if (payload == 0) {
+		atomicAdd(&q->messagesDropped, 1);
+		return SendDropped;
+	}
+	
+	a->msgQueueID = msgQueueID;
+	a->done = done;
+	a->context = context;
+	if (dataLen >= dmaThreshold) {
+		// the M7 wrote the header through its cache, write it out and drop the record's lines so nothing it still
+		// holds can be evicted on top of the bytes the MDMA writes, and write out the source for the MDMA to read
+		cleanShared(payload - q->headerSize, q->headerSize + dataLen);
+		invalidateShared(payload - q->headerSize, q->headerSize + dataLen);
+		cleanShared(data, dataLen);
+		
+		// the completion interrupt commits the message, until then the queue looks full to other sends
+		a->pending = true;
+		if (mdma::copy(sendChannel, payload, data, dataLen, sendDone, a)) { return SendOK; }
+		a->pending = false;
+	}
+	
+	// small payloads cost less to copy than to set up the MDMA for
+	copyBytes(payload, data, dataLen);
+	commitMessage(msgQueueID);
+	if (done != 0) { done(msgQueueID, context); }
+	return SendOK;
+}
+
+
+void messageQueue::setDmaThreshold(uint32_t bytes)
+{
+	// payloads of at least this many bytes are copied by the MDMA, for this core's async calls only
+	dmaThreshold = bytes;
+}
+
+
+uint32_t messageQueue::getDroppedMessages(MessageQueueID msgQueueID)
+{
+	return queue(msgQueueID)->messagesDropped;
+}
+
+
+uint8_t* messageQueue::ringStorage(MessageQueueID msgQueueID, uint32_t* size)
+{
+	// from the layout rather than the control block, so it works before the queue is initialized
+	*size = queueConfig[msgQueueID].size;
+	return ringBuffer(queue(msgQueueID));
+}
+
+
+uint16_t messageQueue::maxPayload(MessageQueueID msgQueueID)
+{
+	// the header, and the timestamp if the queue has them, count against the max message size
+	MessageQueueControl* q = queue(msgQueueID);
+	return q->maxMessageSize - q->headerSize;
+}
+
+
+void messageQueue::getMetrics(MessageQueueID msgQueueID, QueueMetrics* metrics)
+{
+	MessageQueueControl* q = queue(msgQueueID);
+	
+	// read the counters without a lock, each one is written by a single core so a snapshot taken while the queue is
+	// busy is only off by the messages in flight. Only the other core's lines are invalidated, even IDs are sent by
+	// the M4.
+	bool localProducer = ((msgQueueID & 1) == 0) == (localCoreID == m4_coreID);
+	if (localProducer) { invalidateShared(&q->tail, MQ_CONSUMER_BYTES); }
+	else { invalidateShared(&q->head, MQ_PRODUCER_BYTES); }
+	uint32_t tail = q->tail;
+	uint32_t head = q->head;
+	metrics->messagesSent = q->messagesSent;
+	metrics->bytesSent = q->bytesSent;
+	metrics->messagesRead = q->messagesRead;
+	metrics->bytesRead = q->bytesRead;
+	metrics->messagesDropped = q->messagesDropped;
+	metrics->pendingMessages = metrics->messagesSent - metrics->messagesRead;
+	metrics->bytesInQueue = head - tail;
+	metrics->maxPendingMessages = q->maxPendingMessages;
+	metrics->maxBytesInQueue = q->maxBytesInQueue;
+	metrics->producerLockSpins = q->producerLock.spins;
+	metrics->producerLockCycles = q->producerLock.holdCycles;
+	metrics->producerMaxLockCycles = q->producerLock.maxHoldCycles;
+	metrics->consumerLockSpins = q->consumerLock.spins;
+	metrics->consumerLockCycles = q->consumerLock.holdCycles;
+	metrics->consumerMaxLockCycles = q->consumerLock.maxHoldCycles;
+	metrics->size = q->size;
+	
+	// the front message has been waiting since it was published into an empty queue or since the message before it
+	// was released, whichever came last
+	metrics->oldestMessageAge = 0;
+	if (head != tail) {
+		uint32_t frontSince = q->frontSince;
+		uint32_t releasedAt = q->releasedAt;
+		if ((int32_t)(releasedAt - frontSince) > 0) { frontSince = releasedAt; }
+		metrics->oldestMessageAge = (timebase::now() - frontSince) / TB_TICKS_PER_MICROSECOND;
+	}
+}
+
+
+uint8_t* messageQueue::reserveMessage(MessageQueueID msgQueueID, MessageID messageID, uint16_t dataLen)
+{
+	MessageQueueControl* q = queue(msgQueueID);
+	
+	// an async send still holds the reservation until its copy completes, check before looking at head so the
+	// completion interrupt cannot commit in between. On a MultiProducer queue it only holds its own.
+	bool shared = (q->lockMode == MultiProducer);
+	if (asyncCopies[msgQueueID].pending && !shared) { return 0; }
+	
+	// sanity checks
+	uint32_t msgSize = recordSize(q, dataLen);
+	uint32_t head = q->head;
+	if ((q->headerSize + dataLen) > q->maxMessageSize) {
+		SYS_ERROR("message size too large");
+		return 0;
+	}
+	
+	// every context claims room of its own on a MultiProducer queue, the message is counted as sent right away since
+	// the commit does not know which reservation it belongs to
+	if (shared) {
+		MessageDescriptor message = { messageID, dataLen, 0 };
+		uint32_t index;
+		if (!claim(q, &message, 1, &index)) { return 0; }
+		atomicAdd(&q->messagesSent, 1);
+		atomicAdd(&q->bytesSent, dataLen);
+		return writeHeader(q, index, recordStart(q, index, msgSize), messageID, dataLen);
+	}
+	if (q->reservedHead != head) { SYS_ERROR("message queue already has an uncommitted reservation"); }
+	
+	// the consumer only ever moves tail forward so the free space can only grow after this check
+	invalidateShared(&q->tail, sizeof(q->tail));
+	uint32_t start = recordStart(q, head, msgSize);
+	uint32_t bytesInQueue = head - q->tail;
+	if ((q->size - bytesInQueue) < (start - head + msgSize)) { return 0; }
+	
+	acquire(q, &q->producerLock);
+	
+	// write the header past the published head, the producer fills in the payload before calling commitMessage
+	uint8_t* payload = writeHeader(q, head, start, messageID, dataLen);
+	q->reservedHead = start + msgSize;
+	q->reservedBytes = dataLen;
+	return payload;
+}
+
+
+void messageQueue::commitMessage(MessageQueueID msgQueueID)
+{
+	MessageQueueControl* q = queue(msgQueueID);
+	
+	if (q->lockMode == MultiProducer) {
+		if (q->activeProducers == 0) { SYS_ERROR("no message queue reservation to commit"); }
+		leaveProducer(q);
 		return;
 	}
+	if (q->reservedHead == q->head) { SYS_ERROR("no message queue reservation to commit"); }
+	publish(q, 1);
+}
+
+
+bool messageQueue::sendMessages(MessageQueueID msgQueueID, const MessageDescriptor* messages, uint32_t count)
+{
+	MessageQueueControl* q = queue(msgQueueID);
+	bool shared = (q->lockMode == MultiProducer);
 	
-	// spin wait until we acquire a hsem lock on the queue we want
-	while (!lock(q->hsemID, coreID)) { }
+	if (asyncCopies[msgQueueID].pending && !shared) { return false; }
+	uint32_t head = q->head;
+	if ((q->reservedHead != head) && !shared) { SYS_ERROR("message queue already has an uncommitted reservation"); }
+	if (count == 0) { return true; }
+	for (uint32_t i = 0; i < count; ++i) {
+		if ((q->headerSize + messages[i].dataLen) > q->maxMessageSize) { SYS_ERROR("message size too large"); }
+	}
 	
-	// write bytes into the queue
-	writeBytes(q, (uint8_t*)&command, sizeof(MessageID));
-	writeBytes(q, (uint8_t*)&dataLen, sizeof(dataLen));
-	if (dataLen > 0) { writeBytes(q, data, dataLen); }
+	// lay the whole batch out first, including any wrap padding, so it is either written completely or not at all. On
+	// a MultiProducer queue the batch claims its room like a single reservation and is written from there.
+	if (shared) {
+		if (!claim(q, messages, count, &head)) { return false; }
+	} else {
+		invalidateShared(&q->tail, sizeof(q->tail));
+		uint32_t bytesInQueue = head - q->tail;
+		if ((q->size - bytesInQueue) < (batchEnd(q, head, messages, count) - head)) { return false; }
+		acquire(q, &q->producerLock);
+	}
 	
-	// track the maximum number of bytes stored in the queue
-	q->bytesInQueue += sizeof(MessageID) + sizeof(dataLen) + dataLen;
-	if (q->bytesInQueue > q->maxBytesInQueue) { q->maxBytesInQueue = q->bytesInQueue; }
+	// write every message past the published head
+	uint32_t index = head;
+	uint32_t bytes = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t msgSize = recordSize(q, messages[i].dataLen);
+		uint32_t start = recordStart(q, index, msgSize);
+		uint8_t* payload = writeHeader(q, index, start, messages[i].messageID, messages[i].dataLen);
+		copyBytes(payload, messages[i].data, messages[i].dataLen);
+		index = start + msgSize;
+		bytes += messages[i].dataLen;
+	}
 	
-	// track the number of messages waiting to be read
-	q->pendingMessages++;
-	if (q->pendingMessages > q->maxPendingMessages) { q->maxPendingMessages = q->pendingMessages; }
+	if (shared) {
+		atomicAdd(&q->messagesSent, count);
+		atomicAdd(&q->bytesSent, bytes);
+		leaveProducer(q);
+		return true;
+	}
 	
-	// unlock the queue hsem when done
-	unlock(q->hsemID, coreID);
+	// publish the whole batch with a single head update
+	q->reservedHead = index;
+	q->reservedBytes = bytes;
+	publish(q, count);
+	return true;
 }
 
 
 void messageQueue::readMessage(MessageQueueID msgQueueID, MessageQueueBufferType* buffer)
 {
-	// do sketchy pointer math to get the memory location of our quasi-legal message queues,
-	// msgQueueID is 0 for M4toM7, 1 for M7toM4
-	MessageQueue* q = &mq[msgQueueID]; 
-	Core_ID coreID = (msgQueueID) ? m4_coreID : m7_coreID;
-	
-	if (q->pendingMessages == 0) {
+	// copy the next message out of the queue into the buffer
+	MessageView view;
+	if (!peekMessage(msgQueueID, &view)) {
 		SYS_WARN("attempted to read empty message queue");
 	} else {
-		// sanity check
-		uint32_t msgSize = sizeof(MessageID) + sizeof(buffer->dataLen) + buffer->dataLen;
-		if (msgSize > q->bytesInQueue){ SYS_ERROR("message queue underflow"); }
-		
-		// spin wait until we acquire a hsem lock on the queue we want
-		while (!lock(q->hsemID, coreID)) { }
+		buffer->messageID = view.messageID;
+		buffer->dataLen = view.dataLen;
+		copyBytes(buffer->data, view.data, view.dataLen);
+		releaseMessage(msgQueueID);
+	}
+}
+
+
+bool messageQueue::readMessageAsync(MessageQueueID msgQueueID, MessageQueueBufferType* buffer, AsyncCallback done,
+	void* context)
+{
+	AsyncCopy* a = &asyncCopies[msgQueueID];
+	
+	MessageView view;
+	if (!peekMessage(msgQueueID, &view)) { return false; }
+	buffer->messageID = view.messageID;
+	buffer->dataLen = view.dataLen;
+	
+	a->msgQueueID = msgQueueID;
+	a->done = done;
+	a->context = context;
+	a->dest = buffer->data;
+	a->len = view.dataLen;
+	if (view.dataLen >= dmaThreshold) {
+		// on the M7 write out and drop the buffer's lines so no eviction lands on top of the MDMA's bytes, the
+		// completion interrupt drops them again in case they were fetched during the copy
+		cleanShared(buffer, sizeof(buffer->messageID) + sizeof(buffer->dataLen) + view.dataLen);
+		invalidateShared(buffer->data, view.dataLen);
 		
-		// read bytes into the data buffer
-		readBytes(q, (uint8_t*)&buffer->messageID, sizeof(MessageID));
-		readBytes(q, (uint8_t*)&buffer->dataLen, sizeof(buffer->dataLen));
-		if (buffer->dataLen > 0) { readBytes(q, (uint8_t*)buffer->data, buffer->dataLen); }
+		// the completion interrupt releases the message, until then it stays at the front of the queue
+		a->pending = true;
+		if (mdma::copy(receiveChannel, buffer->data, view.data, view.dataLen, readDone, a)) { return true; }
+		a->pending = false;
+	}
+	
+	copyBytes(buffer->data, view.data, view.dataLen);
+	releaseMessage(msgQueueID);
+	if (done != 0) { done(msgQueueID, context); }
+	return true;
+}
+
+
+bool messageQueue::peekMessage(MessageQueueID msgQueueID, MessageView* view)
+{
+	MessageQueueControl* q = queue(msgQueueID);
+	
+	// the front message is already being copied out by readMessageAsync
+	if (asyncCopies[msgQueueID].pending) { return false; }
+	
+	invalidateShared(&q->head, sizeof(q->head));
+	uint32_t tail = q->tail;
+	uint32_t bytesInQueue = q->head - tail;
+	if (bytesInQueue == 0) { return false; }
+	
+	acquire(q, &q->consumerLock);
+	
+	// make sure the head index is read before the message bytes it covers
+	__DMB();
+	
+	// skip over the unused end of the buffer if the producer wrapped back to the start, after that the whole
+	// record is contiguous
+	invalidateRing(q, tail, tail + MQ_HEADER_SIZE);
+	uint32_t index = skipWrap(q, tail);
+	if (index != tail) { invalidateRing(q, index, index + MQ_HEADER_SIZE); }
+	uint32_t header = *ringWord(q, index);
+	uint16_t dataLen = header >> 16;
+	
+	// sanity check
+	uint32_t msgSize = (index - tail) + recordSize(q, dataLen);
+	if (msgSize > bytesInQueue){ SYS_ERROR("message queue underflow"); }
+	invalidateRing(q, index, tail + msgSize);
+	
+	view->messageID = (MessageID)(header & 0xFFFF);
+	view->dataLen = dataLen;
+	view->data = &ringBuffer(q)[(index & q->mask) + q->headerSize];
+	view->hasSendTime = (q->headerSize > MQ_HEADER_SIZE);
+	view->sendTime = view->hasSendTime ? *ringWord(q, index + MQ_HEADER_SIZE) : 0;
+	q->peekedTail = tail + msgSize;
+	q->peekedBytes = dataLen;
+	return true;
+}
+
+
+void messageQueue::releaseMessage(MessageQueueID msgQueueID)
+{
+	MessageQueueControl* q = queue(msgQueueID);
+	
+	uint32_t tail = q->peekedTail;
+	if (tail == q->tail) { SYS_ERROR("no peeked message to release"); }
+	
+	// finish reading the message before handing its space back to the producer
+	__DMB();
+	q->tail = tail;
+	q->messagesRead++;
+	q->bytesRead = q->bytesRead + q->peekedBytes;
+	q->releasedAt = timebase::now();
+	cleanShared(&q->tail, MQ_CONSUMER_BYTES);
+	
+	release(q, &q->consumerLock);
+}
+
+
+uint32_t recordStart(MessageQueueControl* q, uint32_t index, uint32_t msgSize)
+{
+	// records never straddle the end of the buffer, if a record of msgSize bytes does not fit before the end then
+	// the rest of the buffer is skipped and the record starts back at the beginning. Every record is word aligned
+	// so there is always room for the wrap marker in the skipped space.
+	uint32_t remaining = q->size - (index & q->mask);
+	return (remaining < msgSize) ? (index + remaining) : index;
+}
+
+
+uint8_t* writeHeader(MessageQueueControl* q, uint32_t index, uint32_t start, MessageID messageID, uint16_t dataLen)
+{
+	// mark any skipped space so the consumer knows to jump to the start
+	if (start != index) { *ringWord(q, index) = MQ_WRAP_MARKER; }
+	
+	// write the record header, stamp the send time if the queue carries timestamps and return where the payload goes
+	*ringWord(q, start) = messageID | ((uint32_t)dataLen << 16);
+	if (q->headerSize > MQ_HEADER_SIZE) { *ringWord(q, start + MQ_HEADER_SIZE) = timebase::now(); }
+	return &ringBuffer(q)[(start & q->mask) + q->headerSize];
+}
+
+
+void publish(MessageQueueControl* q, uint32_t messageCount)
+{
+	// if the queue was empty the first of these messages goes straight to the front, note when for the age metric
+	if (q->head == q->tail) { q->frontSince = timebase::now(); }
+	
+	// make sure the message bytes land before the consumer can see the new head
+	uint32_t head = q->reservedHead;
+	cleanRing(q, q->head, head);
+	__DMB();
+	q->head = head;
+	q->messagesSent += messageCount;
+	q->bytesSent = q->bytesSent + q->reservedBytes;
+	
+	// track the maximum number of bytes stored in the queue
+	uint32_t bytesInQueue = head - q->tail;
+	if (bytesInQueue > q->maxBytesInQueue) { q->maxBytesInQueue = bytesInQueue; }
+	
+	// track the number of messages waiting to be read
+	uint32_t pendingMessages = q->messagesSent - q->messagesRead;
+	if (pendingMessages > q->maxPendingMessages) { q->maxPendingMessages = pendingMessages; }
+	cleanShared(&q->head, MQ_PRODUCER_BYTES);
+	
+	release(q, &q->producerLock);
+	ringDoorbell(q);
+}
+
+
+uint32_t batchEnd(MessageQueueControl* q, uint32_t index, const MessageDescriptor* messages, uint32_t count)
+{
+	// the index after a batch written from index on, wrap padding included
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t msgSize = recordSize(q, messages[i].dataLen);
+		index = recordStart(q, index, msgSize) + msgSize;
+	}
+	return index;
+}
+
+
+bool claim(MessageQueueControl* q, const MessageDescriptor* messages, uint32_t count, uint32_t* index)
+{
+	// count this context in before claiming room, so a context that interrupts it and commits first leaves its record
+	// to be published later instead of publishing past the record this context is still writing
+	atomicAdd(&q->activeProducers, 1);
+	
+	// claim room past every earlier reservation with an exclusive load/store pair. Exception entry and return clear the
+	// exclusive monitor, so if an interrupt claimed room in between the store fails and the claim starts over past it.
+	invalidateShared(&q->tail, sizeof(q->tail));
+	uint32_t start;
+	uint32_t end;
+	do {
+		start = __LDREXW(&q->reservedHead);
+		end = batchEnd(q, start, messages, count);
+		if ((q->size - (start - q->tail)) < (end - start)) {
+			__CLREX();
+			leaveProducer(q);
+			return false;
+		}
+	} while (__STREXW(end, &q->reservedHead) != 0);
+	
+	*index = start;
+	return true;
+}
+
+
+void leaveProducer(MessageQueueControl* q)
+{
+	// the last context out publishes everything reserved so far, every record before reservedHead is complete by then
+	if (atomicAdd(&q->activeProducers, (uint32_t)-1) == 0) { publishShared(q); }
+}
+
+
+void publishShared(MessageQueueControl* q)
+{
+	// a context that interrupts this one from here on finishes its own send before this one carries on, so nothing up
+	// to reservedHead is left unwritten. Move head up to it unless an interrupt already has, the exclusive store fails
+	// if one published in between and head never moves backwards.
+	uint32_t head;
+	uint32_t reserved;
+	do {
+		head = q->head;
+		reserved = q->reservedHead;
+		if (reserved == head) { return; }
+		if (head == q->tail) { q->frontSince = timebase::now(); }
+		cleanRing(q, head, reserved);
+		__DMB();
+	} while ((__LDREXW(&q->head) != head) || (__STREXW(reserved, &q->head) != 0));
+	
+	// the maximums are metrics only, a race between contexts here can at worst miss a new maximum
+	uint32_t bytesInQueue = reserved - q->tail;
+	if (bytesInQueue > q->maxBytesInQueue) { q->maxBytesInQueue = bytesInQueue; }
+	uint32_t pendingMessages = q->messagesSent - q->messagesRead;
+	if (pendingMessages > q->maxPendingMessages) { q->maxPendingMessages = pendingMessages; }
+	cleanShared(&q->head, MQ_PRODUCER_BYTES);
+	
+	ringDoorbell(q);
+}
+
+
+void ringDoorbell(MessageQueueControl* q)
+{
+	// ring the consumer's doorbell if it is waiting for one, further messages are coalesced into the same
+	// interrupt until the consumer arms the doorbell again
+	__DMB();
+	invalidateShared(&q->doorbellArmed, sizeof(q->doorbellArmed));
+	uint32_t armed = q->doorbellArmed;
+	if (armed != q->doorbellRung) {
+		q->doorbellRung = armed;
+		while (!lock(q->doorbellID, localCoreID)) { }
+		unlock(q->doorbellID, localCoreID);
+	}
+}
+
+
+void sendDone(void* context)
+{
+	// the MDMA has finished writing the payload, publish it from the interrupt
+	AsyncCopy* a = (AsyncCopy*)context;
+	a->pending = false;
+	commitMessage(a->msgQueueID);
+	if (a->done != 0) { a->done(a->msgQueueID, a->context); }
+}
+
+
+void readDone(void* context)
+{
+	// the payload is out of the queue, hand its space back to the producer
+	AsyncCopy* a = (AsyncCopy*)context;
+	invalidateShared(a->dest, a->len);
+	a->pending = false;
+	releaseMessage(a->msgQueueID);
+	if (a->done != 0) { a->done(a->msgQueueID, a->context); }
+}
+
+
+uint32_t skipWrap(MessageQueueControl* q, uint32_t index)
+{
+	// return the index of the next record, jumping to the start of the buffer if the rest of the buffer holds a
+	// wrap marker
+	uint32_t remaining = q->size - (index & q->mask);
+	uint32_t messageID = *ringWord(q, index) & 0xFFFF;
+	return (messageID == MQ_WRAP_MARKER) ? (index + remaining) : index;
+}
+
+
+void cleanRing(MessageQueueControl* q, uint32_t from, uint32_t to)
+{
+	// clean the ring bytes between two free-running indices, in two pieces if the range wraps
+	uint32_t offset = from & q->mask;
+	uint32_t len = to - from;
+	uint32_t first = ((offset + len) > q->size) ? (q->size - offset) : len;
+	cleanShared(&ringBuffer(q)[offset], first);
+	if (first < len) { cleanShared(ringBuffer(q), len - first); }
+}
+
+
+void invalidateRing(MessageQueueControl* q, uint32_t from, uint32_t to)
+{
+	// invalidate the ring bytes between two free-running indices, in two pieces if the range wraps
+	uint32_t offset = from & q->mask;
+	uint32_t len = to - from;
+	uint32_t first = ((offset + len) > q->size) ? (q->size - offset) : len;
+	invalidateShared(&ringBuffer(q)[offset], first);
+	if (first < len) { invalidateShared(ringBuffer(q), len - first); }
+}
+
+
+void messageQueue::cleanShared(const volatile void* addr, uint32_t len)
+{
+#if defined(CORE_CM7) && MQ_M7_DCACHE
+	// write the M7's copy of the lines back to SRAM4 so the M4 can see it, the CMSIS call wants a line aligned start
+	uintptr_t start = (uintptr_t)addr & ~(uintptr_t)(MQ_CACHE_LINE_SIZE - 1);
+	SCB_CleanDCache_by_Addr((uint32_t*)start, (int32_t)((uintptr_t)addr + len - start));
+#else
+	(void)addr;
+	(void)len;
+#endif
+}
+
+
+void messageQueue::invalidateShared(const volatile void* addr, uint32_t len)
+{
+#if defined(CORE_CM7) && MQ_M7_DCACHE
+	// drop the M7's copy of the lines so the next read fetches what the M4 wrote
+	uintptr_t start = (uintptr_t)addr & ~(uintptr_t)(MQ_CACHE_LINE_SIZE - 1);
+	SCB_InvalidateDCache_by_Addr((uint32_t*)start, (int32_t)((uintptr_t)addr + len - start));
+#else
+	(void)addr;
+	(void)len;
+#endif
+}
+
+
+bool deadlinePassed(SendMode mode, uint32_t start, uint32_t timeout)
+{
+	// check whether a blocking send has waited long enough, start is in the units of the mode
+	switch (mode) {
+		case(SendBlockMillis):
+			return (timebase::localMillisSince(start) >= timeout);
 		
-		// track the number of bytes stored in the queue
-		q->bytesInQueue -= msgSize;
+		case(SendBlockCycles):
+			return ((timebase::localCycles() - start) >= timeout);
 		
-		// track the number of messages waiting to be read
-		q->pendingMessages--;
+		case(SendBlock):
+			return false;
 		
-		// unlock the queue hsem when done
-		unlock(q->hsemID, coreID);
+		default:
+			return true;
 	}
 }
 
 
-void writeBytes(MessageQueue* q, uint8_t* data, uint32_t dataLen)
+void acquire(MessageQueueControl* q, LockMetrics* metrics)
 {
-	// copy the specified number of bytes from data souce into the message queue
-	for (uint32_t i = 0; i < dataLen; ++i) {
-		q->buffer[q->head] = data[i];
-		q->head = ((q->head + 1) % MQ_MESSAGE_QUEUE_SIZE);
-		if (q->head == q->tail) { SYS_ERROR("message queue overflow"); }
+	// spin wait until we acquire a hsem lock on the queue, only needed when the queue was set up as HsemLocked
+	if (q->lockMode == HsemLocked) {
+		uint32_t spins = 0;
+		while (!lock(q->hsemID, localCoreID)) { spins++; }
+		metrics->spins += spins;
+		metrics->lockedAt = timebase::localCycles();
 	}
 }
 
 
-void readBytes(MessageQueue* q, uint8_t* dest, uint32_t dataLen)
+void release(MessageQueueControl* q, LockMetrics* metrics)
 {
-	// copy the specified number of bytes from the message queue to the specified data destination
-	for (uint32_t i = 0; i < dataLen; ++i) {
-		dest[i] = q->buffer[q->tail];
-		q->tail = ((q->tail + 1) % MQ_MESSAGE_QUEUE_SIZE);
+	// unlock the queue hsem when done and record how long it was held
+	if (q->lockMode == HsemLocked) {
+		uint32_t cycles = timebase::localCycles() - metrics->lockedAt;
+		metrics->holdCycles += cycles;
+		if (cycles > metrics->maxHoldCycles) { metrics->maxHoldCycles = cycles; }
+		unlock(q->hsemID, localCoreID);
 	}
 }
 
+
+uint32_t atomicAdd(volatile uint32_t* value, uint32_t delta)
+{
+	// add with an exclusive load/store pair, retried if an interrupt on this core got in between, returns the sum
+	uint32_t sum;
+	do {
+		sum = __LDREXW(value) + delta;
+	} while (__STREXW(sum, value) != 0);
+	return sum;
+}
+
+
+uint32_t messageQueue::latencyBucket(uint32_t ticks)
+{
+	// bucket by the number of significant bits, anything past the last bucket is counted in it
+	uint32_t bucket = 32 - __CLZ(ticks);
+	return (bucket < MQ_LATENCY_BUCKETS) ? bucket : (MQ_LATENCY_BUCKETS - 1);
+}
+
+
+void messageQueue::copyBytes(uint8_t* dest, const uint8_t* src, uint32_t len)
+{
+	/* move whole words wherever possible, SRAM4 sits across the D3 bus and every access is expensive, four words per
+	 * pass lets the compiler emit LDM/STM bursts. ipcBench::copyBench compares this with memcpy and the old byte
+	 * loop. */
+	
+	// byte copy until the destination is word aligned
+	while ((len > 0) && ((uintptr_t)dest & 3)) {
+		*dest++ = *src++;
+		len--;
+	}
+	
+	aliasWord* d = (aliasWord*)dest;
+	if (((uintptr_t)src & 3) == 0) {
+		// source is aligned too, burst copy four words at a time then finish the remaining words
+		const aliasWord* s = (const aliasWord*)src;
+		while (len >= 16) {
+			uint32_t w0 = s[0], w1 = s[1], w2 = s[2], w3 = s[3];
+			d[0] = w0; d[1] = w1; d[2] = w2; d[3] = w3;
+			d += 4; s += 4; len -= 16;
+		}
+		while (len >= 4) { *d++ = *s++; len -= 4; }
+		src = (const uint8_t*)s;
+	} else {
+		// source is misaligned, both cores allow unaligned single word loads (but not LDM)
+		while (len >= 4) {
+			*d++ = __UNALIGNED_UINT32_READ(src);
+			src += 4; len -= 4;
+		}
+	}
+	dest = (uint8_t*)d;
+	
+	// copy any trailing bytes
+	while (len > 0) {
+		*dest++ = *src++;
+		len--;
+	}
+}
@@ -0,0 +1,183 @@
+#include "../inc/rpc.h"
+#include "../inc/messageID.h"
+#include "../inc/timebase.h"
+#include "../M4/Code/sys/system.h"
+
+using namespace rpc;
+using namespace messageQueue;
+using namespace hsem;
+
+
+// a call waiting for its response, the slot index is the low RPC_SLOT_BITS of its correlation ID
+struct PendingCall {
+	uint32_t correlationID;								// 0 while the slot is free
+	uint32_t startMillis;
+	uint32_t timeoutMillis;
+	Callback done;
+	void* context;
+};
+
+static_assert((1 << RPC_SLOT_BITS) == RPC_MAX_PENDING, "RPC_SLOT_BITS must match RPC_MAX_PENDING");
+
+static PendingCall calls[RPC_MAX_PENDING];
+static uint32_t nextSequence;
+static Handler handlers[rpcMethodCount];
+
+// requests and responses are put together here, header first, a handler may make calls of its own while its result
+// is being written so each has its own buffer
+static uint8_t requestBuffer[MQ_MAX_MESSAGE_SIZE] __attribute__((aligned(4)));
+static uint8_t responseBuffer[MQ_MAX_MESSAGE_SIZE] __attribute__((aligned(4)));
+
+static void handleRequest(const MessageView* msg);
+static void handleResponse(const MessageView* msg);
+static void complete(PendingCall* pending, RpcStatus status, const uint8_t* result, uint16_t resultLen);
+static RpcStatus ping(const uint8_t* args, uint16_t argsLen, uint8_t* result, uint16_t resultCapacity, uint16_t* resultLen);
+
+
+void rpc::init(void)
+{
+	for (uint32_t i = 0; i < RPC_MAX_PENDING; ++i) { calls[i].correlationID = 0; }
+	for (uint32_t i = 0; i < rpcMethodCount; ++i) { handlers[i] = 0; }
+	registerMethod(rpcMethod_Ping, ping);
+}
+
+
+void rpc::registerMethod(RpcMethod method, Handler handler)
+{
+	if (method >= rpcMethodCount) { SYS_ERROR("invalid rpc method: %d", method); }
+	handlers[method] = handler;
+}
+
+
+uint32_t rpc::call(MessageQueueID lane, RpcMethod method, const uint8_t* args, uint16_t argsLen, uint32_t timeoutMillis,
+	Callback done, void* context)
+{
+	// find a free slot, the correlation ID is a fresh sequence number with the slot index underneath it
+	uint32_t slot = 0;
+	while ((slot < RPC_MAX_PENDING) && (calls[slot].correlationID != 0)) { slot++; }
+	if (slot == RPC_MAX_PENDING) { return 0; }
+	if (argsLen > (MQ_MAX_MESSAGE_SIZE - sizeof(RpcHeader))) { return 0; }
+	
+	nextSequence++;
+	if ((nextSequence << RPC_SLOT_BITS) == 0) { nextSequence++; }
+	uint32_t correlationID = (nextSequence << RPC_SLOT_BITS) | slot;
+	
+	// the response comes back on the lane of the same kind going the other way
+	RpcHeader* header = (RpcHeader*)requestBuffer;
+	header->correlationID = correlationID;
+	header->method = method;
+	header->status = RpcOK;
+	header->replyLane = lane ^ 1;
+	copyBytes(&requestBuffer[sizeof(RpcHeader)], args, argsLen);
+	if (sendMessage(lane, RpcRequest, sizeof(RpcHeader) + argsLen, requestBuffer) != SendOK) { return 0; }
+	
+	PendingCall* pending = &calls[slot];
+	pending->correlationID = correlationID;
+	pending->startMillis = timebase::localMillis();
+	pending->timeoutMillis = timeoutMillis;
+	pending->done = done;
+	pending->context = context;
+	return correlationID;
+}
+
+
+void rpc::handleMessage(const MessageView* msg)
+{
+	if (msg->dataLen < sizeof(RpcHeader)) {
+		SYS_WARN("malformed rpc message");
+		return;
+	}
+	
+	if (msg->messageID == RpcRequest) { handleRequest(msg); }
+	else if (msg->messageID == RpcResponse) { handleResponse(msg); }
+}
+
+
+void rpc::update(void)
+{
+	// time out calls the other core has not answered, their slots are free again before the callback runs
+	for (uint32_t i = 0; i < RPC_MAX_PENDING; ++i) {
+		if ((calls[i].correlationID != 0) && (timebase::localMillisSince(calls[i].startMillis) >= calls[i].timeoutMillis)) {
+			complete(&calls[i], RpcTimedOut, 0, 0);
+		}
+	}
+}
+
+
+uint32_t rpc::pendingCalls(void)
+{
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < RPC_MAX_PENDING; ++i) {
+		if (calls[i].correlationID != 0) { count++; }
+	}
+	return count;
+}
+
+
+void handleRequest(const MessageView* msg)
+{
+	const RpcHeader* request = (const RpcHeader*)msg->data;
+	
+	// the reply lane has to be one this core sends on, even IDs are sent by the M4
+	uint32_t replyLane = request->replyLane;
+	if ((replyLane >= MQ_QUEUE_COUNT) || (((replyLane & 1) == 0) != (localCoreID == m4_coreID))) {
+		SYS_WARN("rpc request with invalid reply lane");
+		return;
+	}
+	
+	// run the handler, its result goes straight into the response after the header
+	uint16_t resultLen = 0;
+	RpcStatus status = RpcUnknownMethod;
+	if ((request->method < rpcMethodCount) && (handlers[request->method] != 0)) {
+		status = handlers[request->method](&msg->data[sizeof(RpcHeader)], msg->dataLen - sizeof(RpcHeader),
+			&responseBuffer[sizeof(RpcHeader)], MQ_MAX_MESSAGE_SIZE - sizeof(RpcHeader), &resultLen);
+		if (status != RpcOK) { resultLen = 0; }
+	}
+	
+	RpcHeader* response = (RpcHeader*)responseBuffer;
+	response->correlationID = request->correlationID;
+	response->method = request->method;
+	response->status = status;
+	response->replyLane = replyLane;
+	SendStatus sent = sendMessage((MessageQueueID)replyLane, RpcResponse, sizeof(RpcHeader) + resultLen, responseBuffer);
+	
+	// a result too large for the reply lane is reported as a failure, a dropped response times out on the caller
+	if (sent == SendTooLarge) {
+		response->status = RpcFailed;
+		sendMessage((MessageQueueID)replyLane, RpcResponse, sizeof(RpcHeader), responseBuffer);
+	}
+}
+
+
+void handleResponse(const MessageView* msg)
+{
+	const RpcHeader* response = (const RpcHeader*)msg->data;
+	
+	// the correlation ID leads straight to its slot, responses to calls that already timed out no longer match
+	PendingCall* pending = &calls[response->correlationID & (RPC_MAX_PENDING - 1)];
+	if ((response->correlationID == 0) || (pending->correlationID != response->correlationID)) {
+		SYS_WARN("rpc response does not match a pending call");
+		return;
+	}
+	complete(pending, response->status, &msg->data[sizeof(RpcHeader)], msg->dataLen - sizeof(RpcHeader));
+}
+
+
+void complete(PendingCall* pending, RpcStatus status, const uint8_t* result, uint16_t resultLen)
+{
+	// free the slot first so the callback can make the next call straight away
+	Callback done = pending->done;
+	void* context = pending->context;
+	pending->correlationID = 0;
+	if (done != 0) { done(status, result, resultLen, context); }
+}
+
+
+RpcStatus ping(const uint8_t* args, uint16_t argsLen, uint8_t* result, uint16_t resultCapacity, uint16_t* resultLen)
+{
+	// echo the arguments back, round trips measure the link and check the other core is answering
+	if (argsLen > resultCapacity) { return RpcFailed; }
+	copyBytes(result, args, argsLen);
+	*resultLen = argsLen;
+	return RpcOK;
+}
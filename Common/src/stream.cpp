@@ -0,0 +1,214 @@
+#include "../inc/stream.h"
+#include "../inc/messageID.h"
+#include "../inc/subscription.h"
+#include "../inc/timebase.h"
+#include "../M4/Code/sys/system.h"
+
+using namespace stream;
+using namespace messageQueue;
+using namespace hsem;
+
+
+// a transfer being written into one of this core's lanes
+struct OutgoingTransfer {
+	const uint8_t* data;								// 0 while the lane is idle
+	uint32_t len;
+	uint32_t offset;									// bytes already written to the ring
+	uint32_t transferID;
+	uint16_t channel;
+	SendCallback done;
+	void* context;
+};
+
+// a transfer being put back together from its fragments
+struct Reassembly {
+	uint32_t transferID;								// 0 while the buffer is free
+	uint32_t totalLen;
+	uint32_t received;									// fragments arrive in order, so also the next offset
+	uint32_t lastMillis;								// when the last fragment arrived
+	uint16_t channel;
+	uint8_t data[STREAM_MAX_TRANSFER_SIZE] __attribute__((aligned(4)));
+};
+
+static OutgoingTransfer outgoing[MQ_QUEUE_COUNT];
+#if STREAM_REASSEMBLY_BUFFERS > 0
+static Reassembly buffers[STREAM_REASSEMBLY_BUFFERS];
+#endif
+static ReceiveCallback receiveCallback;
+static StreamStats stats;
+static uint32_t nextTransferID;
+
+static void writeFragments(MessageQueueID lane);
+static Reassembly* findBuffer(uint32_t transferID);
+
+
+void stream::init(ReceiveCallback receiver)
+{
+	receiveCallback = receiver;
+	for (uint32_t i = 0; i < MQ_QUEUE_COUNT; ++i) { outgoing[i].data = 0; }
+#if STREAM_REASSEMBLY_BUFFERS > 0
+	for (uint32_t i = 0; i < STREAM_REASSEMBLY_BUFFERS; ++i) { buffers[i].transferID = 0; }
+#endif
+	stats = {};
+}
+
+
+uint32_t stream::send(MessageQueueID lane, uint16_t channel, const uint8_t* data, uint32_t len, SendCallback done,
+	void* context)
+{
+	// check inputs, the lane has to be one this core sends on, even IDs are sent by the M4
+	if (lane >= MQ_QUEUE_COUNT) { SYS_ERROR("invalid stream lane: %d", lane); }
+	if (((lane & 1) == 0) != (localCoreID == m4_coreID)) {
+		SYS_WARN("stream lane is sent by the other core");
+		return 0;
+	}
+	if ((data == 0) || (len > STREAM_MAX_TRANSFER_SIZE) || (outgoing[lane].data != 0)) { return 0; }
+	if (!subscription::subscribed((localCoreID == m4_coreID) ? m7_coreID : m4_coreID, StreamFragment)) { return 0; }
+	
+	nextTransferID++;
+	if (nextTransferID == 0) { nextTransferID++; }
+	uint32_t transferID = nextTransferID;
+	outgoing[lane] = { data, len, 0, transferID, channel, done, context };
+	
+	// start the pipeline straight away, the transfer may even be complete before returning
+	writeFragments(lane);
+	return transferID;
+}
+
+
+bool stream::sending(MessageQueueID lane)
+{
+	return (lane < MQ_QUEUE_COUNT) && (outgoing[lane].data != 0);
+}
+
+
+void stream::handleMessage(const MessageView* msg)
+{
+	if (msg->dataLen < sizeof(FragmentHeader)) {
+		SYS_WARN("malformed StreamFragment");
+		return;
+	}
+	const FragmentHeader* header = (const FragmentHeader*)msg->data;
+	const uint8_t* bytes = &msg->data[sizeof(FragmentHeader)];
+	uint32_t len = msg->dataLen - sizeof(FragmentHeader);
+	stats.fragmentsReceived++;
+	
+	// a transfer too large for the reassembly buffers is counted once, on its first fragment
+	if ((header->totalLen > STREAM_MAX_TRANSFER_SIZE) || ((header->offset + len) > header->totalLen)) {
+		if (header->offset == 0) { stats.transfersDropped++; }
+		return;
+	}
+	
+	// a transfer that fits in one fragment needs no reassembly, hand it over in place
+	if ((header->offset == 0) && (len == header->totalLen)) {
+		stats.transfersReceived++;
+		if (receiveCallback != 0) { receiveCallback(header->channel, bytes, len); }
+		return;
+	}
+	
+	// the first fragment claims a buffer, the rest of a transfer that got none are ignored
+	Reassembly* r = findBuffer(header->transferID);
+	if (header->offset == 0) {
+		if (r == 0) { r = findBuffer(0); }
+		if (r == 0) {
+			stats.transfersDropped++;
+			return;
+		}
+		r->transferID = header->transferID;
+		r->totalLen = header->totalLen;
+		r->received = 0;
+		r->channel = header->channel;
+	} else if (r == 0) {
+		return;
+	}
+	
+	// a gap means a fragment went missing and the transfer can not be completed
+	if (header->offset != r->received) {
+		r->transferID = 0;
+		stats.transfersAborted++;
+		return;
+	}
+	
+	copyBytes(&r->data[r->received], bytes, len);
+	r->received += len;
+	r->lastMillis = timebase::localMillis();
+	if (r->received == r->totalLen) {
+		stats.transfersReceived++;
+		if (receiveCallback != 0) { receiveCallback(r->channel, r->data, r->totalLen); }
+		r->transferID = 0;
+	}
+}
+
+
+void stream::update(void)
+{
+	// keep the pipelines full as the other core frees up room in the rings
+	for (uint32_t i = 0; i < MQ_QUEUE_COUNT; ++i) {
+		if (outgoing[i].data != 0) { writeFragments((MessageQueueID)i); }
+	}
+
+#if STREAM_REASSEMBLY_BUFFERS > 0
+	// free buffers whose sender has gone quiet, e.g. after it was reset in the middle of a transfer
+	for (uint32_t i = 0; i < STREAM_REASSEMBLY_BUFFERS; ++i) {
+		if ((buffers[i].transferID != 0) && (timebase::localMillisSince(buffers[i].lastMillis) >= STREAM_TIMEOUT_MILLIS)) {
+			buffers[i].transferID = 0;
+			stats.transfersAborted++;
+		}
+	}
+#endif
+}
+
+
+const StreamStats* stream::getStats(void)
+{
+	return &stats;
+}
+
+
+void writeFragments(MessageQueueID lane)
+{
+	// write as many fragments as the ring has room for, each as large as the lane takes, straight into the ring
+	OutgoingTransfer* t = &outgoing[lane];
+	uint32_t fragmentSize = maxPayload(lane) - sizeof(FragmentHeader);
+	while (t->data != 0) {
+		uint32_t len = t->len - t->offset;
+		if (len > fragmentSize) { len = fragmentSize; }
+		uint8_t* payload = reserveMessage(lane, StreamFragment, sizeof(FragmentHeader) + len);
+		if (payload == 0) { return; }
+		
+		FragmentHeader* header = (FragmentHeader*)payload;
+		header->transferID = t->transferID;
+		header->totalLen = t->len;
+		header->offset = t->offset;
+		header->channel = t->channel;
+		header->reserved = 0;
+		copyBytes(&payload[sizeof(FragmentHeader)], &t->data[t->offset], len);
+		commitMessage(lane);
+		t->offset += len;
+		stats.fragmentsSent++;
+		
+		// free the lane before calling back, so the callback can start the next transfer straight away
+		if (t->offset == t->len) {
+			SendCallback done = t->done;
+			void* context = t->context;
+			uint32_t transferID = t->transferID;
+			t->data = 0;
+			stats.transfersSent++;
+			if (done != 0) { done(transferID, context); }
+		}
+	}
+}
+
+
+Reassembly* findBuffer(uint32_t transferID)
+{
+	// 0 finds a free buffer, a core without reassembly buffers drops every multi-fragment transfer
+#if STREAM_REASSEMBLY_BUFFERS > 0
+	for (uint32_t i = 0; i < STREAM_REASSEMBLY_BUFFERS; ++i) {
+		if (buffers[i].transferID == transferID) { return &buffers[i]; }
+	}
+#else
+	(void)transferID;
+#endif
+	return 0;
+}
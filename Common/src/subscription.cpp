@@ -0,0 +1,78 @@
+#include "../inc/subscription.h"
+#include "../inc/messageQueue.h"
+#include "../inc/messageQueueLayout.h"
+#include "../inc/stm32h745xx.h"
+#include "../inc/stm32h7xx.h"
+#include "../M4/Code/sys/system.h"
+#include <string.h>
+
+using namespace subscription;
+using namespace messageQueue;
+using namespace hsem;
+
+
+static_assert(MessageIDCount <= SUB_MAX_MESSAGE_IDS, "MessageIDs do not fit in the subscription bitmaps");
+
+// the subscriptions live in the SRAM4_MQ region after the mailboxes, see messageQueueLayout.h
+static SubscriptionTable* table(Core_ID coreID)
+{
+	// one table per receiving core, the M4's first
+	return &((MessageQueueLayout*)regionBase())->subscriptions[(coreID == m4_coreID) ? 0 : 1];
+}
+
+static void setBit(MessageID messageID, bool subscribed);
+
+
+void subscription::reset(void)
+{
+	// clear whatever the SRAM4 held before, an unpublished table lets every message through
+	memset(table(m4_coreID), 0, sizeof(SubscriptionTable));
+	memset(table(m7_coreID), 0, sizeof(SubscriptionTable));
+	cleanShared(table(m4_coreID), sizeof(SubscriptionTable));
+	cleanShared(table(m7_coreID), sizeof(SubscriptionTable));
+}
+
+
+void subscription::subscribe(MessageID messageID)
+{
+	setBit(messageID, true);
+}
+
+
+void subscription::unsubscribe(MessageID messageID)
+{
+	setBit(messageID, false);
+}
+
+
+void subscription::publish(void)
+{
+	// the bits have to land before the sender starts trusting them
+	SubscriptionTable* t = table(localCoreID);
+	__DMB();
+	t->published = 1;
+	cleanShared(t, sizeof(SubscriptionTable));
+}
+
+
+bool subscription::subscribed(Core_ID receiver, MessageID messageID)
+{
+	// one word read per send, IDs out of range are left for the receiver to warn about
+	SubscriptionTable* t = table(receiver);
+	if (messageID >= SUB_MAX_MESSAGE_IDS) { return true; }
+	invalidateShared(t, sizeof(SubscriptionTable));
+	if (t->published == 0) { return true; }
+	return (t->bits[messageID / 32] & (1UL << (messageID % 32))) != 0;
+}
+
+
+void setBit(MessageID messageID, bool subscribed)
+{
+	// only this core writes its own table, from its main loop
+	if (messageID >= MessageIDCount) { SYS_ERROR("invalid messageID: %d", messageID); }
+	SubscriptionTable* t = table(localCoreID);
+	uint32_t mask = 1UL << (messageID % 32);
+	uint32_t bits = t->bits[messageID / 32];
+	t->bits[messageID / 32] = subscribed ? (bits | mask) : (bits & ~mask);
+	cleanShared(&t->bits[messageID / 32], sizeof(uint32_t));
+}
@@ -0,0 +1,22 @@
+#include "../inc/timebase.h"
+#include "../inc/stm32h745xx.h"
+#include "../inc/stm32h7xx.h"
+
+
+void timebase::init(void)
+{
+	// TIM2 is a 32-bit timer in the D2 domain that both cores can read, count up from 0 through the whole range
+	SET_BIT(RCC->APB1LENR, RCC_APB1LENR_TIM2EN);						// enable TIM2 clock
+	TIM2->CR1 = 0;														// stopped, upcounting
+	TIM2->PSC = (TB_TIMER_CLOCK_HZ / TB_TICKS_PER_SECOND) - 1;			// no prescaling, 200MHz count rate
+	TIM2->ARR = 0xFFFFFFFF;												// free running 32-bit count
+	TIM2->CNT = 0;
+	TIM2->EGR = TIM_EGR_UG;												// load the prescaler now instead of at the first overflow
+	SET_BIT(TIM2->CR1, TIM_CR1_CEN);									// start counting
+}
+
+
+uint32_t timebase::now(void)
+{
+	return TIM2->CNT;
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+/* host build stand-in for the device header, the simulator emulates the only peripheral the shared message queue
+ * code touches (HSEM) in hsem.cpp and models the MDMA in mdma.cpp, so no register definitions are needed */
@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+/* host build stand-in for the CMSIS intrinsics used by the Common code. The two simulated cores are separate
+ * processes sharing memory, so the barriers become full fences and everything else maps onto a compiler builtin. */
+
+#define __DMB() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define __DSB() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define __ISB() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static inline uint8_t __CLZ(uint32_t value)
+{
+	// CLZ of 0 is 32 on the Cortex-M, the builtin leaves it undefined
+	return (value == 0) ? 32 : __builtin_clz(value);
+}
+
+static inline uint32_t __UNALIGNED_UINT32_READ(const void* addr)
+{
+	uint32_t value;
+	memcpy(&value, addr, sizeof(value));
+	return value;
+}
+
+// interrupts are modelled with signals to the simulated core's main thread, see mdma.cpp
+uint32_t __get_PRIMASK(void);
+void __set_PRIMASK(uint32_t primask);
+void __disable_irq(void);
+void __enable_irq(void);
+
+// exclusive accesses are checked against the value the load saw, and a simulated interrupt clears the monitor on the
+// way out like an exception return does on the chip, see hostSim.cpp
+uint32_t __LDREXW(volatile uint32_t* addr);
+uint32_t __STREXW(uint32_t value, volatile uint32_t* addr);
+void __CLREX(void);
@@ -0,0 +1,304 @@
+#include "hostSim.h"
+#include "../../Common/inc/hsem.h"
+#include "../../Common/inc/messageQueue.h"
+#include "../../Common/inc/timebase.h"
+#include "../../Common/inc/mdma.h"
+#include "../../Common/inc/mailbox.h"
+#include "../../Common/inc/bufferPool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+using namespace hostSim;
+
+
+#define HS_FILE_SIZE (HS_SRAM4_MQ_SIZE + HS_STATE_SIZE)
+
+static_assert(sizeof(SharedState) <= HS_STATE_SIZE, "emulated hardware does not fit in its page");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared atomics must be lock-free to work across processes");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "the interrupt status futex is the atomic's own word");
+
+static SharedState* shared;
+static pthread_t mainThread;
+static InterruptHandler interruptHandler;
+static volatile uint32_t* exclusiveAddress;			// the exclusive monitor, see __LDREXW
+static uint32_t exclusiveValue;
+
+static void sleepMicros(uint32_t micros);
+static uint64_t nanoseconds(void);
+static void onInterruptSignal(int signal);
+
+
+void hostSim::attach(const char* path, bool create)
+{
+	// the M4 starts from a fresh file, so a stale one from an earlier run can never pass the handshake
+	if (create) { unlink(path); }
+	
+	for (;;) {
+		int fd = open(path, create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0600);
+		if (fd >= 0) {
+			struct stat st;
+			if (create && (ftruncate(fd, HS_FILE_SIZE) != 0)) {
+				perror("hostSim: ftruncate");
+				exit(1);
+			}
+			if ((fstat(fd, &st) == 0) && ((uint64_t)st.st_size >= HS_FILE_SIZE)) {
+				// map at the chip's address, the Common code finds the queues through the _sram4_mq symbol
+				void* region = mmap((void*)HS_SRAM4_MQ_ADDRESS, HS_FILE_SIZE, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+				if (region != (void*)HS_SRAM4_MQ_ADDRESS) {
+					perror("hostSim: mmap at the SRAM4_MQ address");
+					exit(1);
+				}
+				close(fd);
+				shared = (SharedState*)((uint8_t*)region + HS_SRAM4_MQ_SIZE);
+				
+				// a file some M7 already started on is left over from an earlier run, wait for the M4 to replace it
+				if (create || (shared->m7Ready.load() == 0)) { break; }
+				munmap(region, HS_FILE_SIZE);
+				fd = -1;
+			}
+			if (fd >= 0) { close(fd); }
+		} else if (create) {
+			perror("hostSim: create");
+			exit(1);
+		}
+		
+		// the M7 keeps waiting until the M4 has created the file
+		sleepMicros(1000);
+	}
+	
+	if (create) { shared->runID.fetch_add(1); }
+	
+	// simulated interrupts are delivered to this thread with a signal
+	mainThread = pthread_self();
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = onInterruptSignal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(HS_INTERRUPT_SIGNAL, &action, 0);
+}
+
+
+void hostSim::detach(const char* path, bool remove)
+{
+	munmap((void*)HS_SRAM4_MQ_ADDRESS, HS_FILE_SIZE);
+	shared = 0;
+	if (remove) { unlink(path); }
+}
+
+
+void hostSim::boot(const char* path, void* config, uint32_t configLen, messageQueue::LockMode lockMode)
+{
+	namespace mq = messageQueue;
+	if (configLen > sizeof(SharedState::config)) {
+		fprintf(stderr, "hostSim: config does not fit\n");
+		exit(1);
+	}
+	
+	// each core initializes the lanes, the mailbox and the buffer pool it sends on, even IDs go from the M4 to the M7
+	uint32_t firstLane = coreIndex();
+	if (coreIndex() == 0) {
+		attach(path, true);
+		timebase::init();
+		hsem::init();
+		memcpy(shared->config, config, configLen);
+		shared->lockMode.store(lockMode);
+		for (uint32_t id = firstLane; id < MQ_QUEUE_COUNT; id += 2) { mq::init((mq::MessageQueueID)id, lockMode, true); }
+		mailbox::init((mailbox::MailboxID)firstLane);
+		bufferPool::init((bufferPool::PoolID)firstLane);
+		mdma::init();
+		startM7();
+		waitForM7();
+		for (uint32_t id = 1; id < MQ_QUEUE_COUNT; id += 2) {
+			if (!mq::layoutMatches((mq::MessageQueueID)id)) {
+				fprintf(stderr, "hostSim: M7 message queue layout does not match\n");
+				exit(1);
+			}
+		}
+	} else {
+		attach(path, false);
+		waitForStart();
+		memcpy(config, shared->config, configLen);
+		lockMode = (mq::LockMode)shared->lockMode.load();
+		for (uint32_t id = firstLane; id < MQ_QUEUE_COUNT; id += 2) { mq::init((mq::MessageQueueID)id, lockMode, true); }
+		mailbox::init((mailbox::MailboxID)firstLane);
+		bufferPool::init((bufferPool::PoolID)firstLane);
+		mdma::init();
+		signalReady();
+	}
+}
+
+
+void hostSim::shutdown(const char* path)
+{
+	detach(path, coreIndex() == 0);
+}
+
+
+SharedState* hostSim::state(void)
+{
+	return shared;
+}
+
+
+void hostSim::startM7(void)
+{
+	// the equivalent of setting RCC->GCR:BOOT_C1
+	shared->m7Started.store(1);
+}
+
+
+void hostSim::waitForM7(void)
+{
+	// the equivalent of waiting for RCC->GCR:BOOT_C2
+	while (shared->m7Ready.load() == 0) { sleepMicros(100); }
+}
+
+
+void hostSim::waitForStart(void)
+{
+	while (shared->m7Started.load() == 0) { sleepMicros(100); }
+}
+
+
+void hostSim::signalReady(void)
+{
+	shared->m7Ready.store(1);
+}
+
+
+uint32_t hostSim::coreIndex(void)
+{
+	return (hsem::localCoreID == hsem::m4_coreID) ? 0 : 1;
+}
+
+
+void hostSim::setInterruptHandler(InterruptHandler handler)
+{
+	interruptHandler = handler;
+}
+
+
+void hostSim::raiseInterrupt(void)
+{
+	// the handler runs on the main thread wherever it happens to be, just like an interrupt on the core
+	pthread_kill(mainThread, HS_INTERRUPT_SIGNAL);
+}
+
+
+bool hostSim::waitForInterrupt(uint32_t timeoutMillis)
+{
+	// the stand-in for WFI, sleep on the emulated status register until the HSEM sets one of this core's enabled bits.
+	// The futex is shared, so the unlock in the other process wakes this one straight away.
+	uint32_t index = coreIndex();
+	std::atomic<uint32_t>* status = &shared->interruptStatus[index];
+	uint64_t deadline = nanoseconds() + ((uint64_t)timeoutMillis * 1000000ULL);
+	while (true) {
+		uint32_t observed = status->load();
+		if ((observed & shared->interruptEnable[index].load()) != 0) { return true; }
+		uint64_t now = nanoseconds();
+		if (now >= deadline) { return false; }
+		struct timespec timeout = { (time_t)((deadline - now) / 1000000000ULL), (long)((deadline - now) % 1000000000ULL) };
+		syscall(SYS_futex, (uint32_t*)status, FUTEX_WAIT, observed, &timeout, 0, 0);
+	}
+}
+
+
+void hostSim::notifyInterrupt(uint32_t index)
+{
+	syscall(SYS_futex, (uint32_t*)&shared->interruptStatus[index], FUTEX_WAKE, INT32_MAX, 0, 0, 0);
+}
+
+
+void sleepMicros(uint32_t micros)
+{
+	struct timespec ts = { 0, (long)micros * 1000 };
+	nanosleep(&ts, 0);
+}
+
+
+uint64_t nanoseconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+
+void onInterruptSignal(int signal)
+{
+	(void)signal;
+	if (interruptHandler != 0) { interruptHandler(); }
+	
+	// returning from an exception clears the exclusive monitor
+	exclusiveAddress = 0;
+}
+
+
+// PRIMASK only ever masks the simulated interrupt signal
+uint32_t __get_PRIMASK(void)
+{
+	sigset_t current;
+	pthread_sigmask(SIG_BLOCK, 0, &current);
+	return sigismember(&current, HS_INTERRUPT_SIGNAL) ? 1 : 0;
+}
+
+
+void __set_PRIMASK(uint32_t primask)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, HS_INTERRUPT_SIGNAL);
+	pthread_sigmask(primask ? SIG_BLOCK : SIG_UNBLOCK, &mask, 0);
+}
+
+
+void __disable_irq(void)
+{
+	__set_PRIMASK(1);
+}
+
+
+void __enable_irq(void)
+{
+	__set_PRIMASK(0);
+}
+
+
+// exclusive accesses only ever come from the main thread and the simulated interrupts on it
+uint32_t __LDREXW(volatile uint32_t* addr)
+{
+	exclusiveValue = __atomic_load_n(addr, __ATOMIC_SEQ_CST);
+	exclusiveAddress = addr;
+	return exclusiveValue;
+}
+
+
+uint32_t __STREXW(uint32_t value, volatile uint32_t* addr)
+{
+	// fails if an interrupt came in since the load, or the word changed under it, and clears the monitor either way
+	bool armed = (exclusiveAddress == addr);
+	exclusiveAddress = 0;
+	uint32_t expected = exclusiveValue;
+	if (!armed || !__atomic_compare_exchange_n(addr, &expected, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		return 1;
+	}
+	return 0;
+}
+
+
+void __CLREX(void)
+{
+	exclusiveAddress = 0;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include "../../Common/inc/messageQueue.h"
+
+/* Linux stand-in for the hardware the two cores share, so the Common message queue code runs unchanged with one
+ * process playing the M4 and another playing the M7. The SRAM4_MQ region is a shared file mapped at the same address
+ * the linker scripts give _sram4_mq on the chip, and the page after it holds the emulated HSEM registers and the
+ * start-up handshake. Each process is built for one core, with CORE_CM4 or CORE_CM7 selecting localCoreID exactly as
+ * on the target. */
+
+#define HS_SRAM4_MQ_ADDRESS 0x38008000UL				// _sram4_mq in both linker scripts, also passed to the host linker
+#define HS_SRAM4_MQ_SIZE 0x8000UL						// LENGTH(SRAM4_MQ)
+#define HS_STATE_SIZE 0x1000UL							// one page after the region for the emulated hardware
+#define HS_DEFAULT_FILE "/dev/shm/stm32h745_sram4_mq"
+#define HS_INTERRUPT_SIGNAL SIGUSR1						// delivers a simulated interrupt to the core's main thread
+
+namespace hostSim
+{
+	// emulated hardware and handshake shared by both processes, every field is a lock-free atomic so it works across
+	// the process boundary
+	struct SharedState {
+		std::atomic<uint32_t> semaphores[32];			// HSEM R registers, lock bit and the owning coreID
+		std::atomic<uint32_t> interruptEnable[2];		// HSEM IER of the M4 and the M7
+		std::atomic<uint32_t> interruptStatus[2];		// HSEM ISR of the M4 and the M7
+		std::atomic<uint32_t> m7Started;				// set by the M4 once its queues are initialized
+		std::atomic<uint32_t> m7Ready;					// set by the M7 once its queues are initialized
+		std::atomic<uint32_t> runID;					// changes every time the M4 creates the file
+		std::atomic<uint32_t> lockMode;					// LockMode of every lane, chosen by the M4
+		uint8_t config[256];							// written by the M4 before starting the M7, see boot
+	};
+	
+	// the M4 creates and zeroes the file, the M7 waits for it to exist and for the M4 to start it. Both map it at
+	// HS_SRAM4_MQ_ADDRESS and exit on failure.
+	void attach(const char* path, bool create);
+	void detach(const char* path, bool remove);
+	SharedState* state(void);
+	
+	// bring this core up the way the start-up code does on the chip. The M4 creates the file, resets the HSEM,
+	// initializes its lanes with timestamps in lockMode, hands configLen bytes of config and the lock mode to the M7
+	// and starts it, then checks the M7's layout once it is ready. The M7 copies the config out, initializes its lanes
+	// and reports ready, its lockMode is ignored. Each core also initializes the mailbox and buffer pool it sends on,
+	// and both start the MDMA model. shutdown unmaps the file, the M4 also removes it, after which both cores can boot
+	// again.
+	void boot(const char* path, void* config, uint32_t configLen,
+		messageQueue::LockMode lockMode = messageQueue::LockFree);
+	void shutdown(const char* path);
+	
+	void startM7(void);									// M4 side of the start-up handshake
+	void waitForM7(void);
+	void waitForStart(void);							// M7 side
+	void signalReady(void);
+	
+	uint32_t coreIndex(void);							// 0 on the M4, 1 on the M7
+	
+	// run a simulated interrupt handler on this core's main thread whenever another thread raises it, masked by
+	// __disable_irq like on the chip
+	typedef void (*InterruptHandler)(void);
+	void setInterruptHandler(InterruptHandler handler);
+	void raiseInterrupt(void);
+	
+	// sleep until the other core rings one of this core's enabled HSEM interrupts or timeoutMillis passes, the
+	// caller clears the status bits. The emulated HSEM calls notifyInterrupt after setting a core's status bits.
+	bool waitForInterrupt(uint32_t timeoutMillis);
+	void notifyInterrupt(uint32_t index);
+}
@@ -0,0 +1,86 @@
+#include "../../Common/inc/hsem.h"
+#include "../../M4/Code/sys/system.h"
+#include "hostSim.h"
+
+using namespace hsem;
+
+
+/* HSEM block emulated with atomics in the shared page, following the register behaviour of RM0399 11.3 closely
+ * enough for the message queues: a 1-step lock read succeeds for the core that holds or takes the semaphore, an
+ * unlock by the owner frees it and sets the status bit on every core that enabled its interrupt. */
+
+#define HS_HSEM_LOCK (1UL << 31)
+#define HS_HSEM_COREID_Pos 8
+
+
+void hsem::init(void)
+{
+	// the M4 resets the block before starting the M7
+	hostSim::SharedState* s = hostSim::state();
+	for (uint32_t i = 0; i < 32; ++i) { s->semaphores[i].store(0); }
+	for (uint32_t i = 0; i < 2; ++i) {
+		s->interruptEnable[i].store(0);
+		s->interruptStatus[i].store(0);
+	}
+}
+
+
+bool hsem::lock(HSEM_ID hsemID, Core_ID coreID)
+{
+	// check inputs
+	if (hsemID > 31) { SYS_ERROR("invalid hsem_id: %d", hsemID); }
+	if ((coreID != m4_coreID) && (coreID != m7_coreID)) { SYS_ERROR("invalid hsem coreID: %d", coreID); }
+	
+	// take the semaphore if it is free, the read then shows whoever holds it
+	uint32_t locked = HS_HSEM_LOCK | ((uint32_t)coreID << HS_HSEM_COREID_Pos);
+	uint32_t expected = 0;
+	hostSim::state()->semaphores[hsemID].compare_exchange_strong(expected, locked);
+	return (expected == 0) || (expected == locked);
+}
+
+
+void hsem::unlock(HSEM_ID hsemID, Core_ID coreID)
+{
+	// check inputs
+	if (hsemID > 31) { SYS_ERROR("invalid hsem_id: %d", hsemID); }
+	if ((coreID != m4_coreID) && (coreID != m7_coreID)) { SYS_ERROR("invalid coreID: %d", coreID); }
+	
+	// only the owner can release the semaphore, releasing it raises the interrupt on every core that enabled it
+	hostSim::SharedState* s = hostSim::state();
+	uint32_t locked = HS_HSEM_LOCK | ((uint32_t)coreID << HS_HSEM_COREID_Pos);
+	if (s->semaphores[hsemID].compare_exchange_strong(locked, 0)) {
+		for (uint32_t i = 0; i < 2; ++i) {
+			if (s->interruptEnable[i].load() & (1UL << hsemID)) {
+				s->interruptStatus[i].fetch_or(1UL << hsemID);
+				hostSim::notifyInterrupt(i);
+			}
+		}
+	}
+}
+
+
+bool hsem::isLocked(HSEM_ID hsemID)
+{
+	// check inputs
+	if (hsemID > 31) { SYS_ERROR("invalid hsem_id: %d", hsemID); }
+	
+	return (hostSim::state()->semaphores[hsemID].load() & HS_HSEM_LOCK) != 0;
+}
+
+
+void hsem::enableInterrupt(HSEM_ID hsemID)
+{
+	// check inputs
+	if (hsemID > 31) { SYS_ERROR("invalid hsem_id: %d", hsemID); }
+	
+	hostSim::state()->interruptEnable[hostSim::coreIndex()].fetch_or(1UL << hsemID);
+}
+
+
+void hsem::clearInterrupt(HSEM_ID hsemID)
+{
+	// check inputs
+	if (hsemID > 31) { SYS_ERROR("invalid hsem_id: %d", hsemID); }
+	
+	hostSim::state()->interruptStatus[hostSim::coreIndex()].fetch_and(~(1UL << hsemID));
+}
@@ -0,0 +1,102 @@
+#include "../../Common/inc/mdma.h"
+#include "../../M4/Code/sys/system.h"
+#include "hostSim.h"
+#include <string.h>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+using namespace mdma;
+
+
+/* model of the MDMA completion path. A worker thread stands in for the DMA engine and moves the bytes while the
+ * simulated core keeps running, then raises the completion interrupt, which runs the callback on the core's main
+ * thread at whatever point it has reached. That is the ordering the async queue calls have to survive on the chip:
+ * the commit or release can land between any two instructions of the code that started the copy. */
+
+#define MDMA_CHANNEL_COUNT 16
+
+struct Copy {
+	void* dest;
+	const void* src;
+	uint32_t len;
+	Callback done;
+	void* context;
+};
+
+static Copy copies[MDMA_CHANNEL_COUNT];
+static std::atomic<uint32_t> activeChannels;			// started and not yet completed
+static std::atomic<uint32_t> queuedChannels;			// waiting for the engine
+static std::atomic<uint32_t> completedChannels;			// waiting for the interrupt handler
+static std::mutex* engineMutex;					// never destroyed, the engine is still waiting on them at exit
+static std::condition_variable* engineWake;
+
+static void engine(void);
+static void irqHandler(void);
+
+
+void mdma::init(void)
+{
+	// the engine lives as long as the process
+	hostSim::setInterruptHandler(irqHandler);
+	engineMutex = new std::mutex;
+	engineWake = new std::condition_variable;
+	std::thread(engine).detach();
+}
+
+
+bool mdma::busy(MDMA_Channel channel)
+{
+	return (activeChannels.load() & (1UL << channel)) != 0;
+}
+
+
+bool mdma::copy(MDMA_Channel channel, void* dest, const void* src, uint32_t len, Callback done, void* context)
+{
+	// check inputs
+	if (channel >= MDMA_CHANNEL_COUNT) { SYS_ERROR("invalid mdma channel: %d", channel); }
+	if (busy(channel)) { return false; }
+	
+	copies[channel] = { dest, src, len, done, context };
+	activeChannels.fetch_or(1UL << channel);
+	{
+		std::lock_guard<std::mutex> lock(*engineMutex);
+		queuedChannels.fetch_or(1UL << channel);
+	}
+	engineWake->notify_one();
+	return true;
+}
+
+
+void engine(void)
+{
+	for (;;) {
+		uint32_t queued;
+		{
+			std::unique_lock<std::mutex> lock(*engineMutex);
+			engineWake->wait(lock, [] { return queuedChannels.load() != 0; });
+			queued = queuedChannels.exchange(0);
+		}
+		
+		// move the bytes, make them visible, then interrupt the core
+		for (uint32_t channel = 0; channel < MDMA_CHANNEL_COUNT; ++channel) {
+			if (queued & (1UL << channel)) { memcpy(copies[channel].dest, copies[channel].src, copies[channel].len); }
+		}
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		completedChannels.fetch_or(queued);
+		hostSim::raiseInterrupt();
+	}
+}
+
+
+void irqHandler(void)
+{
+	// free each channel before calling back, so the callback can start the next copy straight away
+	uint32_t completed = completedChannels.exchange(0);
+	for (uint32_t channel = 0; channel < MDMA_CHANNEL_COUNT; ++channel) {
+		if (completed & (1UL << channel)) {
+			activeChannels.fetch_and(~(1UL << channel));
+			if (copies[channel].done != 0) { copies[channel].done(copies[channel].context); }
+		}
+	}
+}
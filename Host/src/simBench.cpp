@@ -0,0 +1,511 @@
+#include "../../Common/inc/messageQueue.h"
+#include "../../Common/inc/timebase.h"
+#include "../../Common/inc/stream.h"
+#include "../../Common/inc/mailbox.h"
+#include "../../Common/inc/bufferPool.h"
+#include "../../Common/inc/rpc.h"
+#include "../../Common/inc/hsem.h"
+#include "../../M4/Code/sys/system.h"
+#include "hostSim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <vector>
+#include <algorithm>
+
+namespace mq = messageQueue;
+
+
+/* throughput and latency benchmark between the simulated cores. Build it once per core (sim_m4 and sim_m7), start
+ * sim_m7 with just the shared file and sim_m4 with the options, the M4 passes them on to the M7 through the shared
+ * page. One core sends numbered messages on a lane and the other reads them, checking every payload byte and
+ * measuring how long each waited from its send timestamp.
+ *
+ * With -t the messages are stream transfers of that many bytes instead, split into fragments and put back together.
+ * -v varies the message size from 4 up to -s bytes, so over enough messages the records wrap the ring at every
+ * offset. -m picks the lock mode of the lanes, with both the cores run the benchmark once in each mode and the
+ * reading core reports the difference in throughput. -w picks how the reading core waits for messages, polling
+ * hasMessages or sleeping on the lane's doorbell interrupt, with both it reports the latencies of the two side by side.
+ * The latencies only show the wake-up once the sender is paced with -r so the queue runs empty.
+ *
+ * -c checks the modules the benchmark does not use instead, the sender writes one mailbox value, sends one buffer pool
+ * block of -s bytes and makes one rpc ping on the lane, the reader checks the value and the block and answers the
+ * ping, and the sender waits for the ping's response and its block to come back.
+ *
+ *   sim_m4 [-f file] [-n messages] [-s size] [-l normal|control|bulk] [-r rate] [-b burst] [-a dmaThreshold]
+ *          [-t transferSize] [-R] [-v] [-m lockfree|hsem|both] [-w poll|doorbell|both] [-c]
+ *   sim_m7 [-f file] */
+
+// benchmark settings, written by the M4 into SharedState::config before it starts the M7
+struct BenchConfig {
+	uint32_t messages;									// messages to send
+	uint32_t size;										// payload bytes per message, at least 4 for the sequence number
+	uint32_t lane;										// 0 normal, 1 control, 2 bulk
+	uint32_t rate;										// messages per second, 0 sends as fast as the queue allows
+	uint32_t burst;										// messages sent back to back between rate pauses
+	uint32_t dmaThreshold;								// send with sendMessageAsync and this MDMA threshold, 0 for sendMessage
+	uint32_t reverse;									// the M7 sends and the M4 reads
+	uint32_t transferSize;								// send stream transfers of this size, 0 for single messages
+	uint32_t varySize;									// sizes run from 4 to size bytes instead of all being size
+	uint32_t lockModes;									// 0 LockFree, 1 HsemLocked, 2 one run in each
+	uint32_t wakeModes;									// 0 poll, 1 doorbell, 2 one run in each
+	uint32_t check;										// pass a mailbox value, a pool block and a ping instead
+};
+
+// what the reading core measured in one run
+struct RunResult {
+	double perSecond;									// messages or transfers
+	double p50Micros;									// send to dispatch
+	double p99Micros;
+	double maxMicros;
+};
+
+static const char* laneNames[] = { "normal", "control", "bulk" };
+static const char* lockModeNames[] = { "lockfree", "hsem", "both" };
+static const char* wakeModeNames[] = { "poll", "doorbell", "both" };
+static uint32_t wakeMode;								// of the current run
+static uint32_t sleeps;									// times the reader slept on the doorbell
+static volatile uint32_t asyncDone;
+static uint8_t transfer[STREAM_MAX_TRANSFER_SIZE];
+static uint32_t transfersReceived;
+static uint32_t transferErrors;
+static const uint32_t checkValue = 0x600DF00D;			// the mailbox value and the ping's argument
+static const uint32_t checkMillis = 1000;				// how long -c waits for the other core's half
+static uint32_t pingsAnswered;
+
+static void parseArgs(int argc, char** argv, const char** path, BenchConfig* config);
+static void send(const BenchConfig* config, mq::MessageQueueID msgQueueID);
+static RunResult receive(const BenchConfig* config, mq::MessageQueueID msgQueueID);
+static void onAsyncDone(mq::MessageQueueID msgQueueID, void* context);
+static void sendStream(const BenchConfig* config, mq::MessageQueueID msgQueueID);
+static RunResult receiveStream(const BenchConfig* config, mq::MessageQueueID msgQueueID);
+static void waitForMessages(mq::MessageQueueID msgQueueID);
+static void onTransfer(uint16_t channel, const uint8_t* data, uint32_t len);
+static void sendCheck(const BenchConfig* config, mq::MessageQueueID msgQueueID);
+static void receiveCheck(const BenchConfig* config, mq::MessageQueueID msgQueueID);
+static void onPing(rpc::RpcStatus status, const uint8_t* result, uint16_t resultLen, void* context);
+static uint32_t messageSize(const BenchConfig* config, uint32_t sequence);
+static void fillPayload(uint8_t* payload, uint32_t sequence, uint32_t size);
+static bool checkPayload(const uint8_t* payload, uint32_t sequence, uint32_t size);
+
+
+int main(int argc, char** argv)
+{
+	const char* path = HS_DEFAULT_FILE;
+	BenchConfig config;
+	bool m4 = (hsem::localCoreID == hsem::m4_coreID);
+	parseArgs(argc, argv, &path, &config);
+	
+	// one run per lock mode and wake mode, both cores boot again for the next. The M7 only learns how many runs there
+	// are from the config it gets on its first boot.
+	RunResult results[2][2] = {};
+	for (uint32_t run = 0; run < (((config.lockModes == 2) ? 2u : 1u) * ((config.wakeModes == 2) ? 2u : 1u)); ++run) {
+		uint32_t lockRun = (config.wakeModes == 2) ? (run / 2) : run;
+		uint32_t lockMode = (config.lockModes == 2) ? lockRun : config.lockModes;
+		hostSim::boot(path, &config, sizeof(config), (mq::LockMode)lockMode);
+		lockMode = hostSim::state()->lockMode.load();
+		wakeMode = (config.wakeModes == 2) ? (run % 2) : config.wakeModes;
+		
+		// even lanes go from the M4 to the M7
+		mq::MessageQueueID msgQueueID = (mq::MessageQueueID)((config.lane * 2) + (config.reverse ? 1 : 0));
+		if (config.size > mq::maxPayload(msgQueueID)) { config.size = mq::maxPayload(msgQueueID); }
+		bool sender = (m4 != (config.reverse != 0));
+		if (config.check != 0) {
+			if (sender) { sendCheck(&config, msgQueueID); }
+			else { receiveCheck(&config, msgQueueID); }
+		} else if (config.transferSize != 0) {
+			if (sender) { sendStream(&config, msgQueueID); }
+			else { results[lockMode][wakeMode] = receiveStream(&config, msgQueueID); }
+		} else {
+			if (sender) { send(&config, msgQueueID); }
+			else { results[lockMode][wakeMode] = receive(&config, msgQueueID); }
+		}
+		
+		hostSim::shutdown(path);
+	}
+	
+	// what taking the hardware semaphore for every send and read costs on this lane, for each way of waiting
+	uint32_t lane = (config.lane * 2) + (config.reverse ? 1 : 0);
+	for (uint32_t wake = 0; (config.lockModes == 2) && (wake < 2); ++wake) {
+		const RunResult* lockFree = &results[mq::LockFree][wake];
+		const RunResult* locked = &results[mq::HsemLocked][wake];
+		if (lockFree->perSecond <= 0) { continue; }
+		printf("compare lane=%u wake=%s lockfree_per_s=%.0f hsem_per_s=%.0f hsem_vs_lockfree_pct=%.1f\n", lane,
+			wakeModeNames[wake], lockFree->perSecond, locked->perSecond,
+			((locked->perSecond / lockFree->perSecond) - 1.0) * 100.0);
+	}
+	
+	// how much later a message is dispatched when the reader sleeps on the doorbell instead of polling
+	for (uint32_t lock = 0; (config.wakeModes == 2) && (lock < 2); ++lock) {
+		const RunResult* poll = &results[lock][0];
+		const RunResult* doorbell = &results[lock][1];
+		if (poll->perSecond <= 0) { continue; }
+		printf("wake lane=%u mode=%s poll_p50_us=%.2f poll_p99_us=%.2f poll_max_us=%.2f doorbell_p50_us=%.2f "
+			"doorbell_p99_us=%.2f doorbell_max_us=%.2f\n", lane, lockModeNames[lock], poll->p50Micros,
+			poll->p99Micros, poll->maxMicros, doorbell->p50Micros, doorbell->p99Micros, doorbell->maxMicros);
+	}
+	return 0;
+}
+
+
+void parseArgs(int argc, char** argv, const char** path, BenchConfig* config)
+{
+	*config = { 100000, 64, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0 };
+	
+	int option;
+	while ((option = getopt(argc, argv, "f:n:s:l:r:b:a:t:Rvm:w:c")) != -1) {
+		switch (option) {
+			case('f'): *path = optarg; break;
+			case('n'): config->messages = strtoul(optarg, 0, 0); break;
+			case('s'): config->size = strtoul(optarg, 0, 0); break;
+			case('r'): config->rate = strtoul(optarg, 0, 0); break;
+			case('b'): config->burst = strtoul(optarg, 0, 0); break;
+			case('a'): config->dmaThreshold = strtoul(optarg, 0, 0); break;
+			case('t'): config->transferSize = strtoul(optarg, 0, 0); break;
+			case('R'): config->reverse = 1; break;
+			case('v'): config->varySize = 1; break;
+			case('c'): config->check = 1; break;
+			case('l'):
+				for (uint32_t i = 0; i < 3; ++i) {
+					if (strcmp(optarg, laneNames[i]) == 0) { config->lane = i; }
+				}
+				break;
+			case('m'):
+				for (uint32_t i = 0; i < 3; ++i) {
+					if (strcmp(optarg, lockModeNames[i]) == 0) { config->lockModes = i; }
+				}
+				break;
+			case('w'):
+				for (uint32_t i = 0; i < 3; ++i) {
+					if (strcmp(optarg, wakeModeNames[i]) == 0) { config->wakeModes = i; }
+				}
+				break;
+			
+			default:
+				fprintf(stderr, "usage: %s [-f file] [-n messages] [-s size] [-l normal|control|bulk] [-r rate] "
+					"[-b burst] [-a dmaThreshold] [-t transferSize] [-R] [-v] [-m lockfree|hsem|both] "
+					"[-w poll|doorbell|both] [-c]\n", argv[0]);
+				exit(1);
+		}
+	}
+	
+	if (config->size < 4) { config->size = 4; }
+	if (config->burst == 0) { config->burst = 1; }
+	if (config->transferSize > STREAM_MAX_TRANSFER_SIZE) { config->transferSize = STREAM_MAX_TRANSFER_SIZE; }
+}
+
+
+void send(const BenchConfig* config, mq::MessageQueueID msgQueueID)
+{
+	static uint8_t payload[MQ_MAX_MESSAGE_SIZE] __attribute__((aligned(4)));
+	if (config->dmaThreshold != 0) { mq::setDmaThreshold(config->dmaThreshold); }
+	
+	uint32_t startMillis = timebase::localMillis();
+	uint64_t start = timebase::now();
+	for (uint32_t sequence = 0; sequence < config->messages; ++sequence) {
+		// pace the bursts if a rate was asked for, the timebase wraps so only compare the elapsed ticks
+		if ((config->rate != 0) && ((sequence % config->burst) == 0)) {
+			uint64_t due = ((uint64_t)sequence * TB_TICKS_PER_SECOND) / config->rate;
+			while ((uint32_t)(timebase::now() - start) < due) { sched_yield(); }
+		}
+		
+		uint32_t size = messageSize(config, sequence);
+		fillPayload(payload, sequence, size);
+		if (config->dmaThreshold == 0) {
+			while (mq::sendMessage(msgQueueID, NoOp, size, payload) != mq::SendOK) { sched_yield(); }
+		} else {
+			// the payload buffer is reused, so wait for each copy to land before writing the next sequence number
+			asyncDone = 0;
+			while (mq::sendMessageAsync(msgQueueID, NoOp, size, payload, onAsyncDone, 0) != mq::SendOK) {
+				sched_yield();
+			}
+			while (asyncDone == 0) { sched_yield(); }
+		}
+	}
+	
+	mq::QueueMetrics metrics;
+	mq::getMetrics(msgQueueID, &metrics);
+	printf("send lane=%u mode=%s messages=%u size=%u millis=%u full_retries=%u\n", msgQueueID,
+		lockModeNames[hostSim::state()->lockMode.load()], config->messages, config->size,
+		timebase::localMillisSince(startMillis), metrics.messagesDropped);
+}
+
+
+RunResult receive(const BenchConfig* config, mq::MessageQueueID msgQueueID)
+{
+	std::vector<uint32_t> latencies;
+	latencies.reserve(config->messages);
+	if (wakeMode == 1) { mq::enableDoorbell(msgQueueID); }
+	sleeps = 0;
+	
+	uint32_t firstSent = 0;
+	uint32_t lastRead = 0;
+	uint32_t errors = 0;
+	uint64_t bytes = 0;
+	for (uint32_t sequence = 0; sequence < config->messages; ++sequence) {
+		mq::MessageView msg;
+		while (!mq::peekMessage(msgQueueID, &msg)) { waitForMessages(msgQueueID); }
+		
+		// the messages must arrive complete, intact and in order
+		if ((msg.dataLen != messageSize(config, sequence)) || !checkPayload(msg.data, sequence, msg.dataLen)) {
+			errors++;
+		}
+		bytes += msg.dataLen;
+		
+		uint32_t now = timebase::now();
+		if (sequence == 0) { firstSent = msg.sendTime; }
+		latencies.push_back(now - msg.sendTime);
+		lastRead = now;
+		mq::releaseMessage(msgQueueID);
+	}
+	
+	// throughput from the first send to the last read, latencies from each send to its read
+	std::sort(latencies.begin(), latencies.end());
+	double seconds = (double)(lastRead - firstSent) / TB_TICKS_PER_SECOND;
+	double tickMicros = 1.0 / TB_TICKS_PER_MICROSECOND;
+	RunResult result = { config->messages / seconds, latencies[latencies.size() / 2] * tickMicros,
+		latencies[(latencies.size() * 99) / 100] * tickMicros, latencies.back() * tickMicros };
+	printf("read lane=%u mode=%s wake=%s messages=%u size=%u seconds=%.3f msgs_per_s=%.0f mbytes_per_s=%.2f "
+		"p50_us=%.2f p99_us=%.2f max_us=%.2f sleeps=%u errors=%u\n", msgQueueID,
+		lockModeNames[hostSim::state()->lockMode.load()], wakeModeNames[wakeMode], config->messages, config->size,
+		seconds, result.perSecond, bytes / seconds / 1e6, result.p50Micros, result.p99Micros, result.maxMicros, sleeps,
+		errors);
+	return result;
+}
+
+
+void onAsyncDone(mq::MessageQueueID msgQueueID, void* context)
+{
+	(void)msgQueueID;
+	(void)context;
+	asyncDone = 1;
+}
+
+
+void sendStream(const BenchConfig* config, mq::MessageQueueID msgQueueID)
+{
+	// every transfer carries its number in every byte, so a fragment put in the wrong place shows up on the receiver
+	stream::init(0);
+	uint32_t startMillis = timebase::localMillis();
+	for (uint32_t sequence = 0; sequence < config->messages; ++sequence) {
+		while (stream::sending(msgQueueID)) {
+			stream::update();
+			sched_yield();
+		}
+		memset(transfer, (uint8_t)sequence, config->transferSize);
+		stream::send(msgQueueID, 0, transfer, config->transferSize);
+	}
+	while (stream::sending(msgQueueID)) {
+		stream::update();
+		sched_yield();
+	}
+	
+	const stream::StreamStats* stats = stream::getStats();
+	printf("send lane=%u transfers=%u size=%u millis=%u fragments=%u\n", msgQueueID, stats->transfersSent,
+		config->transferSize, timebase::localMillisSince(startMillis), stats->fragmentsSent);
+}
+
+
+RunResult receiveStream(const BenchConfig* config, mq::MessageQueueID msgQueueID)
+{
+	stream::init(onTransfer);
+	transfersReceived = 0;
+	transferErrors = 0;
+	if (wakeMode == 1) { mq::enableDoorbell(msgQueueID); }
+	sleeps = 0;
+	std::vector<uint32_t> latencies;
+	uint32_t firstSent = 0;
+	uint32_t lastRead = 0;
+	while (transfersReceived < config->messages) {
+		mq::MessageView msg;
+		if (!mq::peekMessage(msgQueueID, &msg)) {
+			waitForMessages(msgQueueID);
+			continue;
+		}
+		if ((transfersReceived == 0) && (firstSent == 0)) { firstSent = msg.sendTime; }
+		stream::handleMessage(&msg);
+		mq::releaseMessage(msgQueueID);
+		lastRead = timebase::now();
+		latencies.push_back(lastRead - msg.sendTime);
+	}
+	
+	// latencies are per fragment, from its send to the reader being done with it
+	const stream::StreamStats* stats = stream::getStats();
+	std::sort(latencies.begin(), latencies.end());
+	double seconds = (double)(lastRead - firstSent) / TB_TICKS_PER_SECOND;
+	double tickMicros = 1.0 / TB_TICKS_PER_MICROSECOND;
+	RunResult result = { transfersReceived / seconds, latencies[latencies.size() / 2] * tickMicros,
+		latencies[(latencies.size() * 99) / 100] * tickMicros, latencies.back() * tickMicros };
+	printf("read lane=%u mode=%s wake=%s transfers=%u size=%u seconds=%.3f transfers_per_s=%.0f mbytes_per_s=%.2f "
+		"fragments=%u p50_us=%.2f p99_us=%.2f max_us=%.2f sleeps=%u dropped=%u aborted=%u errors=%u\n", msgQueueID,
+		lockModeNames[hostSim::state()->lockMode.load()], wakeModeNames[wakeMode], transfersReceived,
+		config->transferSize, seconds, result.perSecond,
+		((double)transfersReceived * config->transferSize) / seconds / 1e6, stats->fragmentsReceived, result.p50Micros,
+		result.p99Micros, result.maxMicros, sleeps, stats->transfersDropped, stats->transfersAborted, transferErrors);
+	return result;
+}
+
+
+void waitForMessages(mq::MessageQueueID msgQueueID)
+{
+	// polling gives the sender the CPU and looks again. The doorbell clears the emulated HSEM status first, so a ring
+	// after the clear still ends the wait, and sleeps unless arming finds a message already published.
+	if (wakeMode == 0) {
+		sched_yield();
+		return;
+	}
+	hsem::clearInterrupt((msgQueueID & 1) ? hsem::hsemID_DoorbellM7toM4 : hsem::hsemID_DoorbellM4toM7);
+	if (mq::armDoorbell(msgQueueID)) {
+		sleeps++;
+		hostSim::waitForInterrupt(1000);
+	}
+}
+
+
+void onTransfer(uint16_t channel, const uint8_t* data, uint32_t len)
+{
+	// transfers arrive in order and whole
+	(void)channel;
+	bool intact = true;
+	for (uint32_t i = 0; i < len; ++i) { intact &= (data[i] == (uint8_t)transfersReceived); }
+	if (!intact) { transferErrors++; }
+	transfersReceived++;
+}
+
+
+void sendCheck(const BenchConfig* config, mq::MessageQueueID msgQueueID)
+{
+	// boot initialized this core's mailbox and pool, which go the same way as the lane
+	uint32_t errors = 0;
+	if (!mailbox::write((mailbox::MailboxID)(msgQueueID & 1), SetLED, sizeof(checkValue), (const uint8_t*)&checkValue)) {
+		errors++;
+	}
+	
+	bufferPool::PoolID poolID = (bufferPool::PoolID)(msgQueueID & 1);
+	uint32_t blocks = bufferPool::freeBlocks(poolID);
+	uint32_t size = (config->size < BP_BLOCK_SIZE) ? config->size : BP_BLOCK_SIZE;
+	bufferPool::BlockHandle handle = bufferPool::alloc(poolID);
+	if (handle == 0) {
+		errors++;
+	} else {
+		fillPayload(bufferPool::data(handle), 0, size);
+		if (bufferPool::sendBlock(msgQueueID, BlockData, handle, size, mq::SendBlock) != mq::SendOK) { errors++; }
+	}
+	
+	rpc::init();
+	pingsAnswered = 0;
+	if (rpc::call(msgQueueID, rpc::rpcMethod_Ping, (const uint8_t*)&checkValue, sizeof(checkValue), checkMillis, onPing,
+		0) == 0) {
+		errors++;
+	}
+	
+	// the response comes back on the lane going the other way, the block once the reader has freed it
+	mq::MessageQueueID replyID = (mq::MessageQueueID)(msgQueueID ^ 1);
+	uint32_t startMillis = timebase::localMillis();
+	while (((rpc::pendingCalls() > 0) || (bufferPool::freeBlocks(poolID) < blocks)) &&
+		(timebase::localMillisSince(startMillis) < checkMillis)) {
+		mq::MessageView msg;
+		if (mq::peekMessage(replyID, &msg)) {
+			if (msg.messageID == RpcResponse) { rpc::handleMessage(&msg); }
+			mq::releaseMessage(replyID);
+		} else {
+			sched_yield();
+		}
+		rpc::update();
+	}
+	
+	uint32_t returned = (bufferPool::freeBlocks(poolID) == blocks);
+	if ((pingsAnswered == 0) || (returned == 0)) { errors++; }
+	printf("check send lane=%u mode=%s size=%u ping=%u block_returned=%u errors=%u\n", msgQueueID,
+		lockModeNames[hostSim::state()->lockMode.load()], size, pingsAnswered, returned, errors);
+}
+
+
+void receiveCheck(const BenchConfig* config, mq::MessageQueueID msgQueueID)
+{
+	// the mailbox is read while waiting for the block and the ping, the sender writes it before sending either
+	rpc::init();
+	uint32_t size = (config->size < BP_BLOCK_SIZE) ? config->size : BP_BLOCK_SIZE;
+	uint32_t lastSequence = 0;
+	uint32_t valueRead = 0;
+	uint32_t blocksFreed = 0;
+	uint32_t pingsHandled = 0;
+	uint32_t errors = 0;
+	uint32_t startMillis = timebase::localMillis();
+	while (((valueRead == 0) || (blocksFreed == 0) || (pingsHandled == 0)) &&
+		(timebase::localMillisSince(startMillis) < checkMillis)) {
+		mailbox::MailboxValue value;
+		if (mailbox::read((mailbox::MailboxID)(msgQueueID & 1), &lastSequence, &value)) {
+			if ((value.messageID != SetLED) || (value.dataLen != sizeof(checkValue)) ||
+				(memcmp(value.data, &checkValue, sizeof(checkValue)) != 0)) {
+				errors++;
+			}
+			valueRead++;
+		}
+		
+		mq::MessageView msg;
+		if (!mq::peekMessage(msgQueueID, &msg)) {
+			sched_yield();
+			continue;
+		}
+		if (msg.messageID == BlockData) {
+			// the block is read in place and handed back to the sender's pool
+			const bufferPool::BlockMessage* block = (const bufferPool::BlockMessage*)msg.data;
+			const uint8_t* data = bufferPool::receiveBlock(block);
+			if ((data == 0) || (block->dataLen != size) || !checkPayload(data, 0, block->dataLen)) { errors++; }
+			if (data != 0) {
+				bufferPool::free(block->handle);
+				blocksFreed++;
+			}
+		} else if (msg.messageID == RpcRequest) {
+			rpc::handleMessage(&msg);
+			pingsHandled++;
+		}
+		mq::releaseMessage(msgQueueID);
+	}
+	
+	if ((valueRead == 0) || (blocksFreed == 0) || (pingsHandled == 0)) { errors++; }
+	printf("check read lane=%u mode=%s size=%u mailbox=%u block=%u ping=%u errors=%u\n", msgQueueID,
+		lockModeNames[hostSim::state()->lockMode.load()], size, valueRead, blocksFreed, pingsHandled, errors);
+}
+
+
+void onPing(rpc::RpcStatus status, const uint8_t* result, uint16_t resultLen, void* context)
+{
+	// ping returns its argument
+	(void)context;
+	if ((status == rpc::RpcOK) && (resultLen == sizeof(checkValue)) &&
+		(memcmp(result, &checkValue, sizeof(checkValue)) == 0)) {
+		pingsAnswered++;
+	}
+}
+
+
+uint32_t messageSize(const BenchConfig* config, uint32_t sequence)
+{
+	// stepping by a prime spreads the sizes, and so where each record starts, over the whole range
+	if (config->varySize == 0) { return config->size; }
+	return 4 + ((sequence * 7919) % (config->size - 3));
+}
+
+
+void fillPayload(uint8_t* payload, uint32_t sequence, uint32_t size)
+{
+	// the sequence number, then bytes that differ with both the sequence and their offset
+	memcpy(payload, &sequence, sizeof(sequence));
+	for (uint32_t i = sizeof(sequence); i < size; ++i) { payload[i] = (uint8_t)((sequence * 31) + i); }
+}
+
+
+bool checkPayload(const uint8_t* payload, uint32_t sequence, uint32_t size)
+{
+	uint32_t received;
+	memcpy(&received, payload, sizeof(received));
+	if (received != sequence) { return false; }
+	for (uint32_t i = sizeof(sequence); i < size; ++i) {
+		if (payload[i] != (uint8_t)((sequence * 31) + i)) { return false; }
+	}
+	return true;
+}
@@ -0,0 +1,144 @@
+#include "../../Common/inc/messageQueue.h"
+#include "../../Common/inc/ipcBench.h"
+#include "hostSim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+namespace mq = messageQueue;
+
+
+/* the Common ipcBench sweep between the simulated cores, so the host numbers come from the same code and print in the
+ * same format as the ones measured on the chip. Build it once per core (ipcbench_m4 and ipcbench_m7), start
+ * ipcbench_m7 with just the shared file and ipcbench_m4 with the options. Each list takes up to IPC_BENCH_MAX_STEPS
+ * comma separated values, anything not given comes from ipcBench::defaultSweep. With -c the M4 times
+ * ipcBench::copyBench through its bulk lane's ring at each of those sizes instead of running the sweep, e.g.
+ * -c 16,256,1536.
+ *
+ *   ipcbench_m4 [-f file] [-l normal|control|bulk] [-n messages] [-s sizes] [-b bursts] [-F fillPercents] [-R]
+ *               [-c copySizes]
+ *   ipcbench_m7 [-f file] */
+
+// sweep settings, written by the M4 into SharedState::config before it starts the M7
+struct SweepOptions {
+	ipcBench::SweepConfig sweep;
+	uint32_t reverse;									// the M7 runs the sweep and the M4 receives
+	uint32_t copySizeCount;								// run the copy benchmark instead of the sweep
+	uint16_t copySizes[IPC_BENCH_MAX_STEPS];
+};
+
+static const char* laneNames[] = { "normal", "control", "bulk" };
+
+static void parseArgs(int argc, char** argv, const char** path, SweepOptions* options);
+static uint32_t parseList(const char* list, uint16_t* values);
+static bool dispatch(void);
+
+
+int main(int argc, char** argv)
+{
+	const char* path = HS_DEFAULT_FILE;
+	SweepOptions options;
+	parseArgs(argc, argv, &path, &options);
+	
+	hostSim::boot(path, &options, sizeof(options));
+	
+	// the copy benchmark needs no other core, the M7 only starts up and shuts down again
+	if (options.copySizeCount > 0) {
+		if (hostSim::coreIndex() == 0) {
+			ipcBench::printCopyHeader();
+			for (uint32_t i = 0; i < options.copySizeCount; ++i) {
+				ipcBench::CopyResult result;
+				ipcBench::copyBench(mq::M4toM7_Bulk, options.copySizes[i], &result);
+				ipcBench::printCopyResult(&result);
+			}
+		}
+		hostSim::shutdown(path);
+		return 0;
+	}
+	
+	// the sender runs the sweep, the receiver only answers it, both dispatch the other core's messages meanwhile and
+	// give the other process the CPU whenever there was nothing to dispatch
+	bool sender = ((hostSim::coreIndex() == 0) != (options.reverse != 0));
+	if (sender) {
+		ipcBench::printHeader();
+		ipcBench::startSweep(&options.sweep);
+		while (ipcBench::running()) {
+			if (!dispatch()) { sched_yield(); }
+			ipcBench::update();
+		}
+	} else {
+		while (ipcBench::completedSweeps() == 0) {
+			if (!dispatch()) { sched_yield(); }
+		}
+	}
+	
+	hostSim::shutdown(path);
+	return 0;
+}
+
+
+void parseArgs(int argc, char** argv, const char** path, SweepOptions* options)
+{
+	uint32_t lane = 0;
+	options->reverse = 0;
+	options->copySizeCount = 0;
+	ipcBench::defaultSweep(mq::M4toM7, &options->sweep);
+	
+	int option;
+	while ((option = getopt(argc, argv, "f:l:n:s:b:F:Rc:")) != -1) {
+		switch (option) {
+			case('f'): *path = optarg; break;
+			case('n'): options->sweep.messagesPerCase = strtoul(optarg, 0, 0); break;
+			case('s'): options->sweep.sizeCount = parseList(optarg, options->sweep.sizes); break;
+			case('b'): options->sweep.burstCount = parseList(optarg, options->sweep.bursts); break;
+			case('F'): options->sweep.fillCount = parseList(optarg, options->sweep.fillPercents); break;
+			case('R'): options->reverse = 1; break;
+			case('c'): options->copySizeCount = parseList(optarg, options->copySizes); break;
+			case('l'):
+				for (uint32_t i = 0; i < 3; ++i) {
+					if (strcmp(optarg, laneNames[i]) == 0) { lane = i; }
+				}
+				break;
+			
+			default:
+				fprintf(stderr, "usage: %s [-f file] [-l normal|control|bulk] [-n messages] [-s sizes] [-b bursts] "
+					"[-F fillPercents] [-R] [-c copySizes]\n", argv[0]);
+				exit(1);
+		}
+	}
+	
+	// even lanes go from the M4 to the M7
+	options->sweep.msgQueueID = (mq::MessageQueueID)((lane * 2) + options->reverse);
+}
+
+
+uint32_t parseList(const char* list, uint16_t* values)
+{
+	// comma separated, anything past IPC_BENCH_MAX_STEPS values is ignored
+	uint32_t count = 0;
+	char* next = (char*)list;
+	while ((*next != 0) && (count < IPC_BENCH_MAX_STEPS)) {
+		values[count++] = (uint16_t)strtoul(next, &next, 0);
+		if (*next == ',') { next++; }
+		else { break; }
+	}
+	return count;
+}
+
+
+bool dispatch(void)
+{
+	// hand every message the other core sent on any lane to the benchmark, the NoOp fill is skipped there
+	bool dispatched = false;
+	mq::MessageView msg;
+	for (uint32_t id = 1 - hostSim::coreIndex(); id < MQ_QUEUE_COUNT; id += 2) {
+		while (mq::peekMessage((mq::MessageQueueID)id, &msg)) {
+			ipcBench::handleMessage(&msg);
+			mq::releaseMessage((mq::MessageQueueID)id);
+			dispatched = true;
+		}
+	}
+	return dispatched;
+}
@@ -0,0 +1,38 @@
+#include "../../M4/Code/sys/system.h"
+#include "../../Common/inc/timebase.h"
+#include <time.h>
+
+
+/* host versions of the clocks the Common code reads. CLOCK_MONOTONIC is one clock for the whole machine, so like the
+ * TIM2 timebase on the chip a timestamp taken in one simulated core can be compared with the other core's clock. */
+
+static uint64_t nanoseconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+
+uint32_t timebase::localMillis(void)
+{
+	return (uint32_t)(nanoseconds() / 1000000ULL);
+}
+
+
+uint32_t timebase::localCycles(void)
+{
+	// counted at the M4 clock rate, wraps like the DWT counter
+	return (uint32_t)((nanoseconds() * (M4_SYSCLOCK_HZ / 1000000ULL)) / 1000ULL);
+}
+
+
+void timebase::init(void)
+{
+}
+
+
+uint32_t timebase::now(void)
+{
+	return (uint32_t)((nanoseconds() * (TB_TICKS_PER_SECOND / 1000000ULL)) / 1000ULL);
+}
@@ -1,9 +1,46 @@
 #pragma once
 #include "../Common/inc/messageQueue.h"
+#include "../Common/inc/messageID.h"
 
 
 namespace m4_messageProcessor
 {
+	// how many incoming messages update() handles on each pass through the main loop
+	enum DrainPolicy {
+		DrainOne = 0,				// handle at most one message per pass
+		DrainAll = 1,				// handle every pending message, including ones that arrive during the pass
+		DrainCount = 2,				// handle up to limit messages per pass
+		DrainCycles = 3				// keep handling messages until limit M4 clock cycles have elapsed, at least one per pass
+	};
+	
+	// per-pass counts for the current drain policy, reset whenever the policy changes
+	struct DrainStats {
+		uint32_t lastPassMessages;	// messages handled on the most recent pass
+		uint32_t maxPassMessages;	// most messages handled on a single pass
+		uint32_t lastPassCycles;	// M4 clock cycles spent handling messages on the most recent pass
+		uint32_t maxPassCycles;		// most M4 clock cycles spent handling messages on a single pass
+		uint32_t passes;			// passes that handled at least one message
+	};
+	
+	// handles one message, the view and its payload are only valid during the call
+	typedef void (*MessageHandler)(const messageQueue::MessageView* msg);
+	
+	// calls to one MessageID's handler and the M4 clock cycles they took
+	struct HandlerStats {
+		uint32_t calls;
+		uint32_t cycles;			// total over all calls
+		uint32_t maxCycles;			// longest single call
+	};
+	
 	void init(void);
 	void update(void);
+	bool readyToSleep(void);		// arms the M7toM4 doorbells, returns false if messages are already waiting
+	void setDrainPolicy(DrainPolicy policy, uint32_t limit);
+	const DrainStats* getDrainStats(void);
+	const uint32_t* getLatencyHistogram(MessageID messageID);	// send to dispatch delay of M7 messages, 0 if unknown
+	
+	// let a subsystem handle a MessageID from the M7, messages with no handler are warned about and dropped. The M7
+	// only sends MessageIDs that have a handler, see subscription.h.
+	void registerHandler(MessageID messageID, MessageHandler handler);
+	const HandlerStats* getHandlerStats(MessageID messageID);	// 0 if the MessageID is unknown
 }
\ No newline at end of file
@@ -1,49 +1,390 @@
 #include "../inc/m4_messageProcessor.h"
 #include "../Common/inc/messageQueue.h"
+#include "../Common/inc/messageSchema.h"
+#include "../Common/inc/bufferPool.h"
+#include "../Common/inc/rpc.h"
+#include "../Common/inc/ipcBench.h"
+#include "../Common/inc/stream.h"
+#include "../Common/inc/subscription.h"
 #include "../system.h"
 #include "../Common/inc/gpio.h"
 #include "../Common/inc/messageID.h"
+#include "../Common/inc/hsem.h"
+#include "../Common/inc/timebase.h"
+#include "inc/stm32h7xx.h"
 
 using namespace gpio;
 namespace mq = messageQueue;
 
 
-static mq::MessageQueueBufferType mbuf;
+static m4_messageProcessor::DrainPolicy drainPolicy;
+static uint32_t drainLimit;
+static m4_messageProcessor::DrainStats drainStats;
 
-static void processMessage(mq::MessageQueueBufferType* msg);
+// send to dispatch delay of every timestamped message, log2 bucketed per MessageID
+static uint32_t latencyCounts[MessageIDCount][MQ_LATENCY_BUCKETS];
+
+// the M7toM4 lanes in the order they are serviced, strict priority so control traffic always goes first. The
+// M7toM4_LED mailbox is not polled, it only ever carries SetLED and the M4 has no handler for that.
+static const mq::MessageQueueID lanes[] = { mq::M7toM4_Control, mq::M7toM4, mq::M7toM4_Bulk };
+#define LANE_COUNT (sizeof(lanes) / sizeof(lanes[0]))
+
+static bool peekNext(mq::MessageView* msg, mq::MessageQueueID* lane);
+static void recordLatency(const mq::MessageView* msg);
+static void processMessage(const mq::MessageView* msg);
+static void ignoreMessage(const mq::MessageView* msg);
+static void printString(const mq::MessageView* msg);
+static void sendMetrics(const mq::MessageView* msg);
+static void printMetrics(const mq::MessageView* msg);
+static void sendLatency(const mq::MessageView* msg);
+static void printLatency(const mq::MessageView* msg);
+static void receiveBlock(const mq::MessageView* msg);
+#if M4_STREAM_RECEIVE
+static void receiveStream(uint16_t channel, const uint8_t* data, uint32_t len);
+#endif
+static bool keepDraining(uint32_t messages, uint32_t startCycles);
+
+// handler of every MessageID the M4 handles, built at compile time so the table starts out in .data with no start-up
+// code, subsystems add their own with registerHandler
+struct HandlerTable {
+	m4_messageProcessor::MessageHandler handlers[MessageIDCount];
+};
+
+static constexpr HandlerTable defaultHandlers(void)
+{
+	HandlerTable table = {};
+	table.handlers[NoOp] = ignoreMessage;
+	table.handlers[PrintString] = printString;
+	table.handlers[MetricsRequest] = sendMetrics;
+	table.handlers[MetricsReport] = printMetrics;
+	table.handlers[LatencyRequest] = sendLatency;
+	table.handlers[LatencyReport] = printLatency;
+	table.handlers[BlockData] = receiveBlock;
+	table.handlers[RpcRequest] = rpc::handleMessage;
+	table.handlers[RpcResponse] = rpc::handleMessage;
+	table.handlers[BenchControl] = ipcBench::handleMessage;
+	table.handlers[BenchData] = ipcBench::handleMessage;
+	table.handlers[BenchResult] = ipcBench::handleMessage;
+#if M4_STREAM_RECEIVE
+	table.handlers[StreamFragment] = stream::handleMessage;
+#endif
+	return table;
+}
+
+static constexpr HandlerTable builtinHandlers = defaultHandlers();
+static HandlerTable handlerTable = builtinHandlers;
+static m4_messageProcessor::HandlerStats handlerStats[MessageIDCount];
 
 
 void m4_messageProcessor::init(void)
 {
+	setDrainPolicy(DrainCycles, M4_MQ_DRAIN_CYCLES);
+	rpc::init();
+#if M4_STREAM_RECEIVE
+	stream::init(receiveStream);
+#else
+	stream::init(0);
+#endif
+	
+	// tell the M7 which MessageIDs are worth sending, the rest (SetLED, StreamFragment unless M4_STREAM_RECEIVE) it
+	// stops sending once this is published
+	for (uint32_t id = 0; id < MessageIDCount; ++id) {
+		if (handlerTable.handlers[id] != 0) { subscription::subscribe((MessageID)id); }
+	}
+	subscription::publish();
+	
+	// let the M7 wake the M4 through the HSEM2 interrupt when it sends a message on any lane
+	for (uint32_t i = 0; i < LANE_COUNT; ++i) { mq::enableDoorbell(lanes[i]); }
+	NVIC_SetPriority(HSEM2_IRQn, M4_HSEM_IRQ_PRIORITY);
+	NVIC_EnableIRQ(HSEM2_IRQn);
+
+#if M4_IPC_BENCH
+	// the payload copy on its own first, from a small control message up to the largest the normal lane takes. The
+	// M4 has sent nothing on the bulk lane yet, so its ring is free to copy through.
+	static const uint16_t copySizes[] = { 16, 256, 1536 };
+	ipcBench::printCopyHeader();
+	for (uint32_t i = 0; i < (sizeof(copySizes) / sizeof(copySizes[0])); ++i) {
+		ipcBench::CopyResult copy;
+		ipcBench::copyBench(mq::M4toM7_Bulk, copySizes[i], &copy);
+		ipcBench::printCopyResult(&copy);
+	}
+	
+	// the sweep waits in the queue until the M7 is up to read it
+	ipcBench::SweepConfig sweep;
+	ipcBench::defaultSweep(mq::M4toM7, &sweep);
+	ipcBench::printHeader();
+	ipcBench::startSweep(&sweep);
+#endif
 }
 
 
 void m4_messageProcessor::update(void)
 {
-	// if a message exists in the queue, copy it to the local buffer for processsing
-	if (mq::hasMessages(mq::M7toM4)) {
-		mq::readMessage(mq::M7toM4, &mbuf);
-		processMessage(&mbuf);
+	// process messages in place and release their space back to the M7 until the lanes are empty or the drain
+	// policy says to give the rest of the main loop a turn, the highest priority lane is checked again before
+	// every message so a control message never waits behind more than one bulk message
+	uint32_t startCycles = timebase::localCycles();
+	uint32_t messages = 0;
+	mq::MessageView msg;
+	mq::MessageQueueID lane;
+	
+	while (keepDraining(messages, startCycles) && peekNext(&msg, &lane)) {
+		recordLatency(&msg);
+		processMessage(&msg);
+		mq::releaseMessage(lane);
+		messages++;
+	}
+	
+	// complete any calls to the M7 that have waited too long for their response
+	rpc::update();
+	ipcBench::update();
+	stream::update();
+	
+	// record per-pass statistics, passes that found the queue empty are not counted
+	if (messages > 0) {
+		uint32_t cycles = timebase::localCycles() - startCycles;
+		drainStats.lastPassMessages = messages;
+		drainStats.lastPassCycles = cycles;
+		if (messages > drainStats.maxPassMessages) { drainStats.maxPassMessages = messages; }
+		if (cycles > drainStats.maxPassCycles) { drainStats.maxPassCycles = cycles; }
+		drainStats.passes++;
 	}
 }
 
 
-void processMessage(mq::MessageQueueBufferType* msg)
+void m4_messageProcessor::setDrainPolicy(DrainPolicy policy, uint32_t limit)
 {
-	switch (msg->messageID) {
-		case(NoOp):
-			break;
+	// limit is the message count for DrainCount and the cycle budget for DrainCycles, it is ignored otherwise
+	drainPolicy = policy;
+	drainLimit = limit;
+	drainStats = {};
+}
+
+
+bool m4_messageProcessor::readyToSleep(void)
+{
+	// ask the M7 to ring the doorbell with its next message on any lane, if one is already waiting we should not sleep
+	bool empty = true;
+	for (uint32_t i = 0; i < LANE_COUNT; ++i) { empty &= mq::armDoorbell(lanes[i]); }
+	return empty;
+}
+
+
+const m4_messageProcessor::DrainStats* m4_messageProcessor::getDrainStats(void)
+{
+	return &drainStats;
+}
+
+
+void m4_messageProcessor::registerHandler(MessageID messageID, MessageHandler handler)
+{
+	// replaces any handler the ID already had, 0 removes it and the M7 stops sending the ID
+	if (messageID >= MessageIDCount) { SYS_ERROR("invalid messageID: %d", messageID); }
+	handlerTable.handlers[messageID] = handler;
+	if (handler != 0) { subscription::subscribe(messageID); }
+	else { subscription::unsubscribe(messageID); }
+}
+
+
+const m4_messageProcessor::HandlerStats* m4_messageProcessor::getHandlerStats(MessageID messageID)
+{
+	return (messageID < MessageIDCount) ? &handlerStats[messageID] : 0;
+}
+
+
+const uint32_t* m4_messageProcessor::getLatencyHistogram(MessageID messageID)
+{
+	// MQ_LATENCY_BUCKETS counts, bucketed by messageQueue::latencyBucket
+	return (messageID < MessageIDCount) ? latencyCounts[messageID] : 0;
+}
+
+
+bool peekNext(mq::MessageView* msg, mq::MessageQueueID* lane)
+{
+	// peek the next message from the highest priority lane that has one
+	for (uint32_t i = 0; i < LANE_COUNT; ++i) {
+		if (mq::peekMessage(lanes[i], msg)) {
+			*lane = lanes[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+
+bool keepDraining(uint32_t messages, uint32_t startCycles)
+{
+	// decide whether another message may be handled on this pass
+	switch (drainPolicy) {
+		case(m4_messageProcessor::DrainOne):
+			return (messages == 0);
 		
-		case(SetLED):
-			SYS_WARN("M4 does not support SetLED MessageID");
-			break;
+		case(m4_messageProcessor::DrainAll):
+			return true;
 		
-		case(PrintString):
-			// just pretend the string will always be well formed (test code only)
-			printf("%s\n", (char*)&msg->data);
-			break;
+		case(m4_messageProcessor::DrainCount):
+			return (messages < drainLimit);
+		
+		case(m4_messageProcessor::DrainCycles):
+			return (messages == 0) || ((timebase::localCycles() - startCycles) < drainLimit);
 		
 		default:
-			SYS_WARN("unrecognized messageID: %d", msg->messageID);
+			return (messages == 0);
 	}
+}
+
+
+void recordLatency(const mq::MessageView* msg)
+{
+	// only the M7's timestamped lanes carry a send time, unknown MessageIDs get warned about when they are processed
+	if (!msg->hasSendTime || (msg->messageID >= MessageIDCount)) { return; }
+	latencyCounts[msg->messageID][mq::latencyBucket(timebase::now() - msg->sendTime)]++;
+}
+
+
+void processMessage(const mq::MessageView* msg)
+{
+	// a single table lookup per message, IDs without a handler are only warned about
+	m4_messageProcessor::MessageHandler handler = 0;
+	if (msg->messageID < MessageIDCount) { handler = handlerTable.handlers[msg->messageID]; }
+	if (handler == 0) {
+		SYS_WARN("unhandled messageID: %d", msg->messageID);
+		return;
+	}
+	
+	// count every call and the cycles it took
+	uint32_t startCycles = timebase::localCycles();
+	handler(msg);
+	uint32_t cycles = timebase::localCycles() - startCycles;
+	m4_messageProcessor::HandlerStats* stats = &handlerStats[msg->messageID];
+	stats->calls++;
+	stats->cycles += cycles;
+	if (cycles > stats->maxCycles) { stats->maxCycles = cycles; }
+}
+
+
+void ignoreMessage(const mq::MessageView* msg)
+{
+	(void)msg;
+}
+
+
+void printString(const mq::MessageView* msg)
+{
+	// just pretend the string will always be well formed (test code only)
+	printf("%s\n", (const char*)msg->data);
+}
+
+
+void sendMetrics(const mq::MessageView* msg)
+{
+	// report every queue, or just the one selected by the request, on the control lane so the reports do not queue
+	// behind the traffic they describe
+	uint32_t first = 0;
+	uint32_t last = MQ_QUEUE_COUNT - 1;
+	if (msg->dataLen >= 1) {
+		first = msg->data[0];
+		last = msg->data[0];
+	}
+	if (last >= MQ_QUEUE_COUNT) {
+		SYS_WARN("metrics requested for unknown message queue");
+		return;
+	}
+	
+	mq::QueueMetricsReport report;
+	for (uint32_t id = first; id <= last; ++id) {
+		report.msgQueueID = id;
+		mq::getMetrics((mq::MessageQueueID)id, &report.metrics);
+		mq::send<MetricsReport, mq::M4toM7_Control>(report);
+	}
+}
+
+
+void printMetrics(const mq::MessageView* msg)
+{
+	// read the report in place (test code only)
+	const mq::QueueMetricsReport* report = mq::payload<MetricsReport>(msg);
+	if (report == 0) {
+		SYS_WARN("malformed MetricsReport");
+		return;
+	}
+	const mq::QueueMetrics* m = &report->metrics;
+	printf("queue %lu: sent %lu/%luB read %lu/%luB dropped %lu pending %lu/%luB max %lu/%luB age %luus\n",
+		report->msgQueueID, m->messagesSent, m->bytesSent, m->messagesRead, m->bytesRead, m->messagesDropped,
+		m->pendingMessages, m->bytesInQueue, m->maxPendingMessages, m->maxBytesInQueue, m->oldestMessageAge);
+}
+
+
+void sendLatency(const mq::MessageView* msg)
+{
+	// report the histogram of every MessageID, or just the one selected by the request, on the control lane
+	uint32_t first = 0;
+	uint32_t last = MessageIDCount - 1;
+	if (msg->dataLen >= 2) {
+		first = msg->data[0] | (msg->data[1] << 8);
+		last = first;
+	}
+	if (last >= MessageIDCount) {
+		SYS_WARN("latency requested for unknown MessageID");
+		return;
+	}
+	
+	mq::LatencyReport report;
+	report.bucketCount = MQ_LATENCY_BUCKETS;
+	for (uint32_t id = first; id <= last; ++id) {
+		report.messageID = (MessageID)id;
+		mq::copyBytes((uint8_t*)report.counts, (const uint8_t*)latencyCounts[id], sizeof(report.counts));
+		mq::send<LatencyReport, mq::M4toM7_Control>(report);
+	}
+}
+
+
+void printLatency(const mq::MessageView* msg)
+{
+	const mq::LatencyReport* report = mq::payload<LatencyReport>(msg);
+	if (report == 0) {
+		SYS_WARN("malformed LatencyReport");
+		return;
+	}
+	
+	// print the non-empty buckets as upper bound in timebase ticks and count, reading the report in place (test code only)
+	printf("latency of MessageID %u:", report->messageID);
+	for (uint32_t i = 0; i < MQ_LATENCY_BUCKETS; ++i) {
+		if (report->counts[i] > 0) { printf(" <%lu:%lu", (1UL << i), report->counts[i]); }
+	}
+	printf("\n");
+}
+
+
+void receiveBlock(const mq::MessageView* msg)
+{
+	const bufferPool::BlockMessage* block = mq::payload<BlockData>(msg);
+	if (block == 0) {
+		SYS_WARN("malformed BlockData");
+		return;
+	}
+	
+	// nothing on the M4 consumes block data yet, hand the block straight back to the M7's pool
+	if (bufferPool::receiveBlock(block) == 0) {
+		SYS_WARN("BlockData with invalid handle");
+		return;
+	}
+	bufferPool::free(block->handle);
+}
+
+
+#if M4_STREAM_RECEIVE
+void receiveStream(uint16_t channel, const uint8_t* data, uint32_t len)
+{
+	// nothing on the M4 consumes streamed transfers yet, just show what arrived (test code only)
+	(void)data;
+	printf("stream on channel %u: %lu bytes\n", channel, len);
+}
+#endif
+
+
+extern "C" void HSEM2_IRQHandler()
+{
+	// the M7 released the doorbell semaphore, the interrupt only needs to wake the main loop out of WFI
+	hsem::clearInterrupt(hsem::hsemID_DoorbellM7toM4);
 }
\ No newline at end of file
@@ -4,6 +4,11 @@
 #include "../Common/inc/gpio.h"
 #include "../Common/inc/hsem.h"
 #include "../Common/inc/messageQueue.h"
+#include "../Common/inc/mailbox.h"
+#include "../Common/inc/mdma.h"
+#include "../Common/inc/bufferPool.h"
+#include "../Common/inc/subscription.h"
+#include "../Common/inc/timebase.h"
 #include "inc/m4_messageProcessor.h"
 
 using namespace gpio;
@@ -23,6 +28,8 @@ static void hse_clock_init(void);
 static void m4_nvic_init(void);
 static void m4_fpu_init(void);
 static void m4_systick_init(void);
+static void m4_dwt_init(void);
+static void m4_mdma_init(void);
 static void startM7(void);
 static void waitForM7(void);
 
@@ -38,13 +45,27 @@ void sys4::init(void)
 	m4_nvic_init();
 	m4_fpu_init();
 	m4_systick_init();
+	m4_dwt_init();
+	timebase::init();
 	hsem::init();
-	messageQueue::init(messageQueue::M4toM7);
+	m4_mdma_init();
+	messageQueue::init(messageQueue::M4toM7, messageQueue::LockFree, true);
+	messageQueue::init(messageQueue::M4toM7_Control, messageQueue::MultiProducer, true);	// interrupt handlers may send events here
+	messageQueue::init(messageQueue::M4toM7_Bulk, messageQueue::LockFree, true);
+	mailbox::init(mailbox::M4toM7_LED);
+	bufferPool::init(bufferPool::M4toM7_Pool);
+	subscription::reset();
 	m4_messageProcessor::init();
 	
 	// make the M4 wait while the M7 does its configuration
 	startM7();
 	waitForM7();
+	
+	// the M7 has initialized its outgoing queues by now, make sure it was built with the same queue layout
+	if (!messageQueue::layoutMatches(messageQueue::M7toM4) || !messageQueue::layoutMatches(messageQueue::M7toM4_Control) ||
+		!messageQueue::layoutMatches(messageQueue::M7toM4_Bulk)) {
+		SYS_ERROR("M7 message queue layout does not match");
+	}
 }
 
 
@@ -52,6 +73,12 @@ void sys4::update(void)
 {
 	m4_led_update();
 	m4_messageProcessor::update();
+	
+	// sleep until the next interrupt (SysTick or an M7 doorbell) once there is nothing left to do, interrupts are
+	// masked around the check so one arriving before the WFI still wakes it
+	__disable_irq();
+	if (m4_messageProcessor::readyToSleep()) { __WFI(); }
+	__enable_irq();
 }
 
 
@@ -68,7 +95,7 @@ void m4_led_update(void)
 	if (sys4::getMillisSince(m4_led_millis) > M4_LED_MILLIS) {
 		m4_led_millis = sys4::getMillis();
 		toggle(m4_led);
-		messageQueue::sendMessage(messageQueue::M4toM7, SetLED, 4, (uint8_t*)&m7_led);
+		mailbox::write(mailbox::M4toM7_LED, SetLED, 4, (uint8_t*)&m7_led);
 		m7_led++;
 	}
 }
@@ -204,6 +231,24 @@ void m4_systick_init(void)
 }
 
 
+void m4_dwt_init(void)
+{
+	// start the DWT cycle counter so code can be timed in M4 clock cycles (ARMv7-M Architecture Reference Manual C1.8)
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;						// enable the DWT block
+	DWT->CYCCNT = 0;													// reset the cycle counter
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;								// start counting
+}
+
+
+void m4_mdma_init(void)
+{
+	// the MDMA copies large async message payloads, its completion interrupt publishes them
+	mdma::init();
+	NVIC_SetPriority(MDMA_IRQn, M4_MDMA_IRQ_PRIORITY);
+	NVIC_EnableIRQ(MDMA_IRQn);
+}
+
+
 extern "C" void SysTick_Handler()
 {
 	m4_systick_milliseconds++;
@@ -222,3 +267,16 @@ uint32_t sys4::getMillisSince(uint32_t oldMillis)
 	// each overflow takes ~49.7 days 
 	return (m4_systick_milliseconds >= oldMillis) ? (m4_systick_milliseconds - oldMillis) : (UINT_MAX - oldMillis + m4_systick_milliseconds + 1);
 }
+
+
+uint32_t timebase::localMillis(void)
+{
+	return m4_systick_milliseconds;
+}
+
+
+uint32_t timebase::localCycles(void)
+{
+	// free-running M4 clock cycle count, wraps every ~21 seconds at 200MHz so only use it for differences
+	return DWT->CYCCNT;
+}
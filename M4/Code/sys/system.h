@@ -13,6 +13,19 @@ namespace sys4
 // M4 parameters
 #define M4_SYSCLOCK_HZ	200000000			// M4 core clock rate in Hz
 #define M4_LED_MILLIS	500					// M4 led blink rate in milliseconds
+#define M4_HSEM_IRQ_PRIORITY	14			// M7toM4 doorbell interrupt priority, just above SysTick
+#define M4_MDMA_IRQ_PRIORITY	13			// MDMA copy completion priority, publishes async sends ahead of handling doorbells
+#define M4_MQ_DRAIN_CYCLES	(M4_SYSCLOCK_HZ / 50000)	// default cycle budget for handling incoming messages each loop pass (20us)
+#ifndef M4_IPC_BENCH
+#define M4_IPC_BENCH	0					// 1 runs the ipcBench sweep on the M4toM7 lane after start-up and prints the results
+#endif
+#ifndef M4_STREAM_RECEIVE
+#define M4_STREAM_RECEIVE	0				// 1 subscribes the M4 to streamed transfers from the M7 and links their reassembly buffers
+#endif
+#if defined(CORE_CM4) && !M4_STREAM_RECEIVE
+#undef STREAM_REASSEMBLY_BUFFERS			// replaces the stream.h default whichever header a file includes first
+#define STREAM_REASSEMBLY_BUFFERS	0		// the M4 only sends streams
+#endif
 
 // debug macros
 #ifdef DEBUG